@@ -0,0 +1,155 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#include <arpa/inet.h>
+
+#include "admission.h"
+
+
+static uint64_t nanoseconds() noexcept
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+// The IPv4 address, also as an IPv4-mapped one, or the /64 prefix.
+static uint64_t clientKey(const Address& addr) noexcept
+{
+    if (addr.family() == AF_INET)
+    {
+        auto in = reinterpret_cast<const struct sockaddr_in*>(addr.get());
+        return ntohl(in->sin_addr.s_addr);
+    }
+    if (addr.family() == AF_INET6)
+    {
+        auto in6 = reinterpret_cast<const struct sockaddr_in6*>(addr.get());
+        const uint8_t *bytes = in6->sin6_addr.s6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+            uint32_t v4;
+            memcpy(&v4, bytes + 12, sizeof(v4));
+            return ntohl(v4);
+        }
+        uint64_t prefix;
+        memcpy(&prefix, bytes, sizeof(prefix));
+        return prefix;
+    }
+    return 0;
+}
+
+
+// Counts one more in open unless max are already in.
+static bool acquire(std::atomic<uint32_t>& open, unsigned max) noexcept
+{
+    if (open.fetch_add(1, std::memory_order_relaxed) >= max) {
+        open.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+
+// Takes a token, worth interval, from the bucket that holds depth and
+// is full again at full.
+static bool take(std::atomic<uint64_t>& full, uint64_t now,
+                 uint64_t interval, uint64_t depth) noexcept
+{
+    uint64_t t = full.load(std::memory_order_relaxed);
+    while (true)
+    {
+        uint64_t start = std::max(t, now);
+        if (start + interval > now + depth) {
+            return false;
+        }
+        if (full.compare_exchange_weak(t, start + interval,
+                                       std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+}
+
+
+// Nanoseconds per token and of a full bucket.
+static void bucket(double rate, unsigned burst, uint64_t& interval,
+                   uint64_t& depth)
+{
+    interval = depth = 0;
+    if (rate <= 0) {
+        return;
+    }
+    interval = std::max(1.0, 1e9 / rate);
+    double size = burst ? burst : std::max(1.0, std::ceil(rate));
+    depth = interval * size;
+}
+
+
+Admission::Admission(const AdmissionLimits& limits)
+    : m_limits(limits)
+{
+    bucket(limits.rate, limits.burst, m_interval, m_depth);
+    bucket(limits.clientRate, limits.clientBurst, m_clientInterval,
+           m_clientDepth);
+    if (limits.perClient()) {
+        m_slots.reset(new Slot[SLOTS]);
+    }
+}
+
+
+Admission::Verdict Admission::admit(const Address* client,
+                                    uint32_t& slot) noexcept
+{
+    // Clients whose address is unknown share a slot.
+    slot = 0;
+    if (m_slots && client) {
+        slot = (clientKey(*client) * 0x9e3779b97f4a7c15ull) >> 48;
+    }
+
+    if (m_limits.connections > 0 && !acquire(m_open, m_limits.connections)) {
+        return Verdict::Connections;
+    }
+    Slot *s = m_slots ? &m_slots[slot] : nullptr;
+    if (s && m_limits.clientConnections > 0 &&
+        !acquire(s->open, m_limits.clientConnections))
+    {
+        if (m_limits.connections > 0) {
+            m_open.fetch_sub(1, std::memory_order_relaxed);
+        }
+        return Verdict::ClientConnections;
+    }
+
+    // A client over its own rate takes nothing from the overall one,
+    // and one turned away by the overall rate gets its token back.
+    Verdict verdict = Verdict::Admitted;
+    if (m_interval > 0 || m_clientInterval > 0)
+    {
+        uint64_t now = nanoseconds();
+        bool client = s && m_clientInterval > 0;
+        if (client && !take(s->full, now, m_clientInterval, m_clientDepth)) {
+            verdict = Verdict::ClientRate;
+        }
+        else if (m_interval > 0 && !take(m_full, now, m_interval, m_depth))
+        {
+            if (client) {
+                s->full.fetch_sub(m_clientInterval, std::memory_order_relaxed);
+            }
+            verdict = Verdict::Rate;
+        }
+    }
+    if (verdict != Verdict::Admitted) {
+        release(slot);
+    }
+    return verdict;
+}
+
+
+void Admission::release(uint32_t slot) noexcept
+{
+    if (m_limits.connections > 0) {
+        m_open.fetch_sub(1, std::memory_order_relaxed);
+    }
+    if (m_slots && m_limits.clientConnections > 0) {
+        m_slots[slot].open.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "net.h"
+
+
+// Limits on the clients let in, each off while 0. Rates are in
+// connections per second, with bursts of up to burst connections; a
+// burst of 0 takes a second's worth.
+struct AdmissionLimits
+{
+    unsigned connections       = 0; // open at once
+    unsigned clientConnections = 0; // open at once from one client
+    double   rate              = 0;
+    unsigned burst             = 0;
+    double   clientRate        = 0;
+    unsigned clientBurst       = 0;
+
+    bool perClient() const noexcept {
+        return clientConnections > 0 || clientRate > 0;
+    }
+    bool any() const noexcept {
+        return connections > 0 || rate > 0 || perClient();
+    }
+};
+
+
+// Decides on accept whether a client is served or turned away. All the
+// workers share it, so the limits hold however SO_REUSEPORT spreads the
+// clients, and it never locks nor allocates: the counts are atomics and
+// every rate is a token bucket kept as one atomic time, the one at
+// which the bucket is full again (GCRA).
+//
+// Clients are told apart by their IPv4 address or the /64 of their
+// IPv6 one, which is what a single host usually gets. They are hashed
+// into a fixed table; clients that collide share their limits, which
+// errs on the side of turning them away.
+class Admission
+{
+public:
+    static const size_t SLOTS = 1 << 16;
+
+    enum class Verdict
+    {
+        Admitted,
+        Connections,       // too many open
+        ClientConnections, // too many open from the client
+        Rate,              // too many new ones
+        ClientRate         // too many new ones from the client
+    };
+
+private:
+    struct Slot
+    {
+        std::atomic<uint64_t> full{0}; // nanoseconds, of the bucket
+        std::atomic<uint32_t> open{0};
+    };
+
+    AdmissionLimits m_limits;
+    uint64_t        m_interval;       // nanoseconds per token
+    uint64_t        m_depth;          // nanoseconds of a full bucket
+    uint64_t        m_clientInterval;
+    uint64_t        m_clientDepth;
+
+    std::atomic<uint32_t>   m_open{0};
+    std::atomic<uint64_t>   m_full{0};
+    std::unique_ptr<Slot[]> m_slots; // while there are per-client limits
+
+public:
+    explicit Admission(const AdmissionLimits& limits);
+
+    Admission(const Admission&) = delete;
+    Admission& operator=(const Admission&) = delete;
+
+    bool perClient() const noexcept { return m_slots != nullptr; }
+
+    // Takes the client in, or tells why not. client may be null when
+    // its address is unknown. An admitted client is released with the
+    // slot it was given once it is closed.
+    Verdict admit(const Address* client, uint32_t& slot) noexcept;
+    void release(uint32_t slot) noexcept;
+};
+
+#endif // ADMISSION_H
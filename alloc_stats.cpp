@@ -0,0 +1,43 @@
+#include <cstdlib>
+#include <new>
+
+#include "alloc_stats.h"
+
+
+static thread_local unsigned long allocations = 0;
+
+
+unsigned long threadAllocations() noexcept {
+    return allocations;
+}
+
+
+void* operator new(std::size_t size)
+{
+    ++allocations;
+    if (size == 0) {
+        size = 1;
+    }
+    while (true)
+    {
+        void *p = std::malloc(size);
+        if (p) {
+            return p;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
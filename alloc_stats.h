@@ -0,0 +1,8 @@
+#ifndef ALLOC_STATS_H
+#define ALLOC_STATS_H
+
+// Number of operator new calls made so far by the calling thread. The
+// counter is thread local, so counting costs no synchronization.
+unsigned long threadAllocations() noexcept;
+
+#endif // ALLOC_STATS_H
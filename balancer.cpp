@@ -0,0 +1,247 @@
+#include <algorithm>
+#include <iostream>
+
+#include "balancer.h"
+
+
+constexpr std::chrono::seconds Balancer::MAX_BACKOFF;
+
+
+// FNV-1a, with a final mix so that close inputs land far apart.
+static uint64_t hash(const void* data, size_t len)
+{
+    const unsigned char *p = static_cast<const unsigned char*>(data);
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+
+Balancer::Balancer(const std::vector<BackendAddress>& backends,
+                   Policy policy, unsigned ejectFailures,
+                   long ejectBackoffMs, unsigned seed, Metrics* metrics)
+    : m_policy(policy), m_ejectFailures(ejectFailures),
+      m_ejectBackoff(std::chrono::milliseconds(ejectBackoffMs)),
+      m_metrics(metrics), m_next(0),
+      m_random(0x9e3779b97f4a7c15ULL ^ seed)
+{
+    for (auto& address : backends)
+    {
+        Backend backend;
+        backend.host = address.host;
+        backend.port = address.port;
+        backend.addrs = address.addrs;
+        bool ipv6 = address.host.find(':') != std::string::npos;
+        backend.peer = (ipv6 ? "[" + address.host + "]" : address.host) +
+                       ":" + std::to_string(address.port);
+        m_backends.push_back(std::move(backend));
+    }
+    m_candidates.reserve(m_backends.size());
+    if (!m_backends.empty()) {
+        m_next = seed % m_backends.size();
+    }
+
+    if (policy != Policy::ConsistentHash) {
+        return;
+    }
+    for (size_t i = 0; i < m_backends.size(); ++i)
+    {
+        for (int v = 0; v < VNODES; ++v)
+        {
+            std::string point = m_backends[i].peer + "#" + std::to_string(v);
+            m_ring.emplace_back(hash(point.data(), point.size()), i);
+        }
+    }
+    std::sort(m_ring.begin(), m_ring.end());
+}
+
+
+size_t Balancer::pick(const Address* client, size_t skip)
+{
+    auto now = Clock::now();
+    size_t n = m_backends.size();
+
+    // The candidates in round-robin order from m_next.
+    bool ejected = false; // all of them
+    m_candidates.clear();
+    for (size_t k = 0; k < n; ++k)
+    {
+        size_t i = (m_next + k) % n;
+        if (i != skip && healthy(i, now)) {
+            m_candidates.push_back(i);
+        }
+    }
+    if (m_candidates.empty())
+    {
+        if (skip != NONE) {
+            return NONE;
+        }
+        ejected = true;
+        for (size_t k = 0; k < n; ++k) {
+            m_candidates.push_back((m_next + k) % n);
+        }
+    }
+
+    size_t i;
+    switch (m_policy) {
+    case Policy::LeastConnections:
+        i = leastConnections();
+        break;
+    case Policy::PowerOfTwo:
+        return powerOfTwo();
+    case Policy::ConsistentHash:
+        // With all of them ejected the ring is walked as if they were
+        // healthy, which a time after every ejection makes them.
+        if (client) {
+            return consistentHash(client, ejected ? NONE : skip,
+                                  ejected ? Clock::time_point::max() : now);
+        }
+        i = m_candidates[0];
+        break;
+    default:
+        i = m_candidates[0];
+        break;
+    }
+    m_next = (i + 1) % n;
+    return i;
+}
+
+
+size_t Balancer::leastConnections() const noexcept
+{
+    // Ties go round-robin, or an idle proxy would send every client to
+    // the first backend.
+    size_t best = m_candidates[0];
+    for (size_t i : m_candidates)
+    {
+        if (m_backends[i].active < m_backends[best].active) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+
+size_t Balancer::powerOfTwo() noexcept
+{
+    size_t n = m_candidates.size();
+    if (n == 1) {
+        return m_candidates[0];
+    }
+    size_t a = random() % n;
+    size_t b = random() % (n - 1);
+    if (b >= a) {
+        ++b;
+    }
+    a = m_candidates[a];
+    b = m_candidates[b];
+    return m_backends[b].active < m_backends[a].active ? b : a;
+}
+
+
+size_t Balancer::consistentHash(const Address* client,
+    size_t skip, Clock::time_point now) const noexcept
+{
+    // The first point of a healthy backend clockwise from the client's.
+    // An IPv4 client hashes the same on a dual-stack listener, where it
+    // has an IPv4-mapped IPv6 address.
+    uint64_t h;
+    auto in6 = reinterpret_cast<const struct sockaddr_in6*>(client->get());
+    if (client->family() == AF_INET6 &&
+        !IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr))
+    {
+        h = hash(&in6->sin6_addr, sizeof(in6->sin6_addr));
+    } else if (client->family() == AF_INET6) {
+        h = hash(&in6->sin6_addr.s6_addr[12], 4);
+    } else {
+        auto in = reinterpret_cast<const struct sockaddr_in*>(client->get());
+        h = hash(&in->sin_addr, sizeof(in->sin_addr));
+    }
+    auto iter = std::lower_bound(m_ring.begin(), m_ring.end(),
+                                 std::make_pair(h, (size_t) 0));
+    for (size_t k = 0; k < m_ring.size(); ++k, ++iter)
+    {
+        if (iter == m_ring.end()) {
+            iter = m_ring.begin();
+        }
+        size_t i = iter->second;
+        if (i != skip && healthy(i, now)) {
+            return i;
+        }
+    }
+    return m_candidates[0];
+}
+
+
+void Balancer::succeeded(size_t i)
+{
+    Backend& backend = m_backends[i];
+    if (backend.backoff != Clock::duration::zero()) {
+        std::clog << "backend " << backend.peer << ": healthy again"
+                  << std::endl;
+    }
+    backend.failures = 0;
+    backend.backoff = Clock::duration::zero();
+    backend.ejectedUntil = Clock::time_point();
+}
+
+
+bool Balancer::failed(size_t i)
+{
+    Backend& backend = m_backends[i];
+    ++backend.failures;
+    backend.current = (backend.current + 1) % backend.addrs.size();
+
+    // Failures of connections started before the ejection do not make
+    // it longer.
+    auto now = Clock::now();
+    if (m_ejectFailures == 0 || backend.failures < m_ejectFailures ||
+        now < backend.ejectedUntil)
+    {
+        return false;
+    }
+
+    if (backend.backoff == Clock::duration::zero()) {
+        backend.backoff = m_ejectBackoff;
+    } else {
+        backend.backoff = std::min<Clock::duration>(backend.backoff * 2,
+                                                    MAX_BACKOFF);
+    }
+    backend.ejectedUntil = now + backend.backoff;
+
+    std::clog << "backend " << backend.peer << ": ejected for "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(
+                     backend.backoff).count()
+              << " ms after " << backend.failures << " failures"
+              << std::endl;
+    if (m_metrics) {
+        m_metrics->backendEjections.add();
+    }
+    return true;
+}
+
+
+bool Balancer::update(size_t i, const std::vector<Address>& addrs)
+{
+    Backend& backend = m_backends[i];
+    if (addrs.empty() || addrs == backend.addrs) {
+        return false;
+    }
+    backend.addrs = addrs;
+    backend.current = 0;
+    return true;
+}
+
+
+uint64_t Balancer::random() noexcept
+{
+    m_random ^= m_random << 13;
+    m_random ^= m_random >> 7;
+    m_random ^= m_random << 17;
+    return m_random;
+}
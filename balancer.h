@@ -0,0 +1,128 @@
+#ifndef BALANCER_H
+#define BALANCER_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "metrics.h"
+#include "net.h"
+
+
+struct BackendAddress
+{
+    std::string          host;
+    int                  port = 0;
+    std::vector<Address> addrs; // host resolved
+};
+
+
+// Picks the backend of every new upstream connection of one worker.
+//
+// The connections open to each backend are counted by the worker that
+// opened them, from the start of the connect until the relay closes,
+// so the counts need no locks; least-connections and the power of two
+// choices balance each worker's share of the clients on their own.
+// Consistent hashing maps the client's IP address onto a ring with
+// VNODES points per backend, so a client keeps its backend and adding
+// one only moves the clients of its points.
+//
+// A backend with a host name can have several addresses. Connections
+// go to one of them and move on to the next one when it fails, which
+// takes care of a name that has an IPv6 and an IPv4 address of which
+// only one works.
+//
+// A backend that fails ejectFailures times in a row (connects, TLS
+// handshakes or health probes) is ejected: it is not picked for the
+// backoff, which starts at ejectBackoff and doubles up to MAX_BACKOFF
+// every time the backend fails again right after it. One success
+// brings it back for good. While every backend is ejected they are
+// all picked, a refused client would not tell a recovery.
+class Balancer
+{
+public:
+    enum class Policy
+    {
+        RoundRobin,
+        LeastConnections,
+        PowerOfTwo,       // the less busy of two random backends
+        ConsistentHash,   // on the client's address
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+    struct Backend
+    {
+        std::string       host;
+        int               port;
+        std::string       peer;   // "host:port", the key of its TLS sessions
+        std::vector<Address> addrs;
+        size_t            current  = 0; // the address connected to
+        unsigned          active   = 0;
+        unsigned          failures = 0; // in a row
+        Clock::duration   backoff  = Clock::duration::zero();
+        Clock::time_point ejectedUntil;
+
+        const Address& address() const noexcept { return addrs[current]; }
+    };
+
+    static const size_t NONE = (size_t) -1;
+
+private:
+    static const int VNODES = 160;
+    static constexpr std::chrono::seconds MAX_BACKOFF{30};
+
+    Policy               m_policy;
+    std::vector<Backend> m_backends;
+    unsigned             m_ejectFailures; // 0 never ejects
+    Clock::duration      m_ejectBackoff;
+    Metrics             *m_metrics;
+    size_t               m_next;   // of round-robin, and ties
+    uint64_t             m_random; // xorshift state
+    std::vector<size_t>  m_candidates; // of the current pick
+    std::vector<std::pair<uint64_t, size_t>> m_ring; // sorted by point
+
+public:
+    // seed spreads the round-robin start and the random choices of the
+    // workers. Ejections are counted in metrics when it is set.
+    Balancer(const std::vector<BackendAddress>& backends, Policy policy,
+             unsigned ejectFailures, long ejectBackoffMs,
+             unsigned seed = 0, Metrics* metrics = nullptr);
+
+    size_t size() const noexcept { return m_backends.size(); }
+    Backend& operator[](size_t i) noexcept { return m_backends[i]; }
+    const Backend& operator[](size_t i) const noexcept {
+        return m_backends[i];
+    }
+
+    // Returns the index of the backend for a client, whose address is
+    // only looked at by consistent hashing. A retry passes the backend
+    // that failed as skip and gets NONE if no other one is healthy. The
+    // caller counts the connection with acquire() and release().
+    size_t pick(const Address* client = nullptr, size_t skip = NONE);
+
+    void acquire(size_t i) noexcept { ++m_backends[i].active; }
+    void release(size_t i) noexcept { --m_backends[i].active; }
+
+    // Passive and active health reports, failed() returns true if it
+    // ejected the backend.
+    void succeeded(size_t i);
+    bool failed(size_t i);
+    // Takes the addresses of a new lookup of backend i. Returns false
+    // if they did not change.
+    bool update(size_t i, const std::vector<Address>& addrs);
+    bool healthy(size_t i, Clock::time_point now) const noexcept {
+        return now >= m_backends[i].ejectedUntil;
+    }
+
+private:
+    size_t leastConnections() const noexcept;
+    size_t powerOfTwo() noexcept;
+    size_t consistentHash(const Address* client, size_t skip,
+                          Clock::time_point now) const noexcept;
+    uint64_t random() noexcept;
+};
+
+#endif // BALANCER_H
@@ -0,0 +1,152 @@
+#include <algorithm>
+
+#include "buffer_pool.h"
+
+
+const size_t BufferPool::MIN_SIZE;
+const size_t BufferPool::MAX_SIZE;
+
+BufferPool::~BufferPool()
+{
+    for (auto& free : m_free) {
+        for (char* buf : free) {
+            delete[] buf;
+        }
+    }
+}
+
+
+size_t BufferPool::classOf(size_t size) noexcept
+{
+    size_t c = 0;
+    while (c + 1 < CLASSES && (MIN_SIZE << c) < size) {
+        ++c;
+    }
+    return c;
+}
+
+
+char* BufferPool::acquire(size_t size)
+{
+    auto& free = m_free[classOf(size)];
+    if (free.empty()) {
+        return new char[MIN_SIZE << classOf(size)];
+    }
+    char *buf = free.back();
+    free.pop_back();
+    return buf;
+}
+
+
+void BufferPool::release(char* buf, size_t size) noexcept
+{
+    auto& free = m_free[classOf(size)];
+    if (free.size() >= MAX_FREE) {
+        delete[] buf;
+        return;
+    }
+    free.push_back(buf);
+}
+
+
+RelayBuffer::~RelayBuffer()
+{
+    if (m_data) {
+        m_pool->release(m_data, m_size);
+    }
+}
+
+
+int RelayBuffer::space(struct iovec iov[2])
+{
+    // Growing past the high watermark would not let more data in.
+    if (m_data && m_used == 0 && m_filled &&
+        m_size < std::min(BufferPool::MAX_SIZE, m_pool->highWatermark()))
+    {
+        m_pool->release(m_data, m_size);
+        m_next = m_size * 2;
+        m_data = nullptr;
+        m_filled = false;
+    }
+    if (!m_data) {
+        m_size = m_next;
+        m_data = m_pool->acquire(m_size);
+        m_head = 0;
+    }
+
+    size_t free = m_size - m_used;
+    if (m_used + free > m_pool->highWatermark()) {
+        free = m_pool->highWatermark() > m_used
+            ? m_pool->highWatermark() - m_used : 0;
+    }
+    size_t tail = (m_head + m_used) & (m_size - 1);
+    size_t first = std::min(free, m_size - tail);
+
+    m_offered = free;
+    if (free == 0) {
+        return 0;
+    }
+    iov[0].iov_base = m_data + tail;
+    iov[0].iov_len = first;
+    if (first == free) {
+        return 1;
+    }
+    iov[1].iov_base = m_data;
+    iov[1].iov_len = free - first;
+    return 2;
+}
+
+
+void RelayBuffer::produced(size_t n) noexcept
+{
+    if (n == m_offered) {
+        m_filled = true;
+    }
+    m_used += n;
+    if (m_used >= m_pool->highWatermark()) {
+        m_paused = true;
+    }
+}
+
+
+int RelayBuffer::data(struct iovec iov[2]) const noexcept
+{
+    if (m_used == 0) {
+        return 0;
+    }
+    size_t first = std::min(m_used, m_size - m_head);
+    iov[0].iov_base = m_data + m_head;
+    iov[0].iov_len = first;
+    if (first == m_used) {
+        return 1;
+    }
+    iov[1].iov_base = m_data;
+    iov[1].iov_len = m_used - first;
+    return 2;
+}
+
+
+void RelayBuffer::consumed(size_t n) noexcept
+{
+    m_used -= n;
+    if (m_used <= m_pool->lowWatermark()) {
+        m_paused = false;
+    }
+    // An empty ring starts over, which keeps its free space in one
+    // segment.
+    m_head = m_used == 0 ? 0 : (m_head + n) & (m_size - 1);
+}
+
+
+void RelayBuffer::idle() noexcept
+{
+    if (!m_data || m_used != 0) {
+        return;
+    }
+    m_next = m_filled ? m_size
+                      : std::max(BufferPool::MIN_SIZE, m_size / 2);
+    m_pool->release(m_data, m_size);
+    m_data = nullptr;
+    m_size = 0;
+    m_filled = false;
+}
@@ -0,0 +1,103 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <cstddef>
+#include <vector>
+
+#include <sys/uio.h>
+
+
+// Relay buffers from MIN_SIZE to MAX_SIZE in power-of-two sizes,
+// recycled through a free list per size, and the watermarks the rings
+// of a worker apply. Not thread safe, every worker owns one.
+class BufferPool
+{
+public:
+    static const size_t MIN_SIZE = 4096;
+    static const size_t MAX_SIZE = 65536;
+
+private:
+    static const size_t CLASSES  = 5;  // MIN_SIZE << 0 .. MIN_SIZE << 4
+    static const size_t MAX_FREE = 64; // buffers kept per size
+
+    std::vector<char*> m_free[CLASSES];
+    size_t             m_high;
+    size_t             m_low;
+
+public:
+    // low < high <= MAX_SIZE.
+    explicit BufferPool(size_t highWatermark = MAX_SIZE,
+                        size_t lowWatermark = MAX_SIZE / 2) noexcept
+        : m_high(highWatermark), m_low(lowWatermark) {}
+    ~BufferPool();
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    char* acquire(size_t size);
+    void release(char* buf, size_t size) noexcept;
+
+    size_t highWatermark() const noexcept { return m_high; }
+    size_t lowWatermark() const noexcept { return m_low; }
+
+private:
+    static size_t classOf(size_t size) noexcept;
+};
+
+
+// The ring buffer of one relay direction. Free space and data are
+// handed out as up to two segments for readv(2) and writev(2).
+//
+// Memory is taken from the pool when data is about to arrive and given
+// back by idle() once the ring is empty, so an idle connection holds
+// none. A ring that a single read filled doubles when it runs empty,
+// up to MAX_SIZE; one released without having been filled comes back
+// at half the size.
+//
+// Flow control: the ring holds at most the pool's high watermark and
+// once it got there it counts as full until the writer has drained it
+// to the low watermark. The reader thus stops taking data from a fast
+// peer that the other one does not keep up with, leaves it to the
+// kernel's socket buffers and TCP's window, and resumes with a large
+// read rather than with many small ones.
+class RelayBuffer
+{
+    BufferPool *m_pool;
+    char       *m_data    = nullptr;
+    size_t      m_size    = 0;
+    size_t      m_next    = BufferPool::MIN_SIZE; // size of the next one
+    size_t      m_head    = 0;
+    size_t      m_used    = 0;
+    size_t      m_offered = 0;     // free space of the last space()
+    bool        m_filled  = false; // a read took all space offered
+    bool        m_paused  = false; // above the low watermark after
+                                   // reaching the high one
+
+public:
+    explicit RelayBuffer(BufferPool* pool) noexcept : m_pool(pool) {}
+    ~RelayBuffer();
+
+    RelayBuffer(const RelayBuffer&) = delete;
+    RelayBuffer& operator=(const RelayBuffer&) = delete;
+
+    bool empty() const noexcept { return m_used == 0; }
+    // No space to read into, or held back by the watermarks.
+    bool full() const noexcept {
+        return m_paused || (m_data && m_used == m_size);
+    }
+    size_t size() const noexcept { return m_size; }
+
+    // Free space, acquiring or growing the memory first. Returns the
+    // number of segments, 0 if the ring is full.
+    int space(struct iovec iov[2]);
+    void produced(size_t n) noexcept;
+
+    // Data in the ring, returns the number of segments.
+    int data(struct iovec iov[2]) const noexcept;
+    void consumed(size_t n) noexcept;
+
+    // Releases the memory if the ring is empty.
+    void idle() noexcept;
+};
+
+#endif // BUFFER_POOL_H
@@ -0,0 +1,122 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <string>
+#include <vector>
+
+#include "admission.h"
+#include "balancer.h"
+#include "buffer_pool.h"
+#include "net.h"
+#include "selector.h"
+
+
+struct Config
+{
+    // Numeric IPv4 or IPv6 address or host name of the listener, "::"
+    // takes IPv6 and IPv4 clients.
+    std::string listenAddress = "127.0.0.1";
+    int portToListen = 0;
+
+    // Upstream servers and how the clients are spread over them.
+    std::vector<BackendAddress> backends;
+    Balancer::Policy balancing = Balancer::Policy::RoundRobin;
+
+    // Seconds after which backend host names are looked up again,
+    // 0 resolves them at startup only.
+    long dnsTtl = 30;
+
+    // Consecutive failures that eject a backend, 0 never ejects, and
+    // how long the first ejection lasts.
+    unsigned ejectFailures = 3;
+    long     ejectBackoff  = 1000; // milliseconds
+
+    // Other backends tried when connecting to the picked one fails.
+    unsigned connectRetries = 1;
+
+    // Limits on upstream connects, TLS handshakes (to the clients and
+    // to the upstream), connections without traffic and connections
+    // overall; 0 disables each one.
+    long connectTimeout   = 5000;   // milliseconds
+    long handshakeTimeout = 10000;  // milliseconds
+    long idleTimeout      = 300000; // milliseconds
+    long lifetime         = 0;      // milliseconds
+
+    // Active health probes of every backend, off while healthInterval
+    // is 0.
+    long healthInterval = 0;    // milliseconds
+    long healthTimeout  = 1000; // milliseconds
+
+    // Clients turned away on accept, over all workers.
+    AdmissionLimits admission;
+
+    // Accept queue and TCP options of the listeners and of both legs
+    // of every connection.
+    SocketOptions socketOptions;
+
+    Selector::Backend backend = Selector::Backend::Epoll;
+
+    // Number of event loops, each with its own SO_REUSEPORT listener.
+    int workers = 1;
+    // Pin the workers to CPUs and set SO_INCOMING_CPU on their
+    // listeners, so that a connection is served on the CPU that takes
+    // its packets. Only with several workers.
+    bool incomingCpu = false;
+
+    // Bytes a relay direction buffers before it stops reading, and the
+    // level it has to drain to before reading again.
+    size_t highWatermark = BufferPool::MAX_SIZE;
+    size_t lowWatermark  = BufferPool::MAX_SIZE / 2;
+
+    // Bytes a relay direction moves per wakeup before it lets the
+    // other connections of the loop run, and clients accepted per
+    // wakeup (accepts kept running with io_uring). A small batch
+    // favours the connections being served, a large one new clients.
+    size_t   relayBudget = 4 * BufferPool::MAX_SIZE;
+    unsigned acceptBatch = 16;
+
+    // Move plain TCP through a kernel pipe with splice(2) instead of
+    // copying it through userspace.
+    bool splice = false;
+
+    // Certificate chain and key for terminating TLS from the clients,
+    // the listener speaks plain TCP while they are empty.
+    std::string certFile;
+    std::string keyFile;
+
+    // Let the kernel encrypt upstream TLS (kTLS) where it can.
+    bool ktls = false;
+
+    // Threads that run the TLS handshakes of all workers, 0 runs them
+    // on the event loops.
+    unsigned handshakeThreads = 0;
+
+    // TLS sessions kept for resumption on either side, 0 disables them.
+    size_t sessionCacheSize = 64;
+    long   sessionLifetime  = 300; // seconds
+
+    // Upstream connections opened (and TLS handshaked) ahead of time,
+    // the pool is off while poolMax is 0.
+    size_t poolMin         = 0;
+    size_t poolMax         = 0;
+    long   poolIdleTimeout = 30; // seconds
+
+    // How long the connections may take to finish after the proxy was
+    // asked to stop gracefully, 0 cuts them at once.
+    long drainTimeout = 30000; // milliseconds
+
+    // Unix socket over which a new process takes the listening sockets
+    // over from the running one, which then drains; empty disables
+    // hot restarts.
+    std::string restartPath;
+
+    // Port of the Prometheus metrics endpoint on the loopback
+    // interface, 0 disables it. It also serves the latency traces.
+    int metricsPort = 0;
+
+    // Closed connections whose latency trace each worker keeps for
+    // GET /trace and SIGUSR1, 0 disables tracing.
+    size_t traceSize = 4096;
+};
+
+#endif // CONFIG_H
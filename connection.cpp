@@ -0,0 +1,297 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "connection.h"
+
+
+void Connection::close()
+{
+    if (m_closing) {
+        return;
+    }
+    m_closing = true;
+    m_trace.bytesUp = m_upstream.total;
+    m_trace.bytesDown = m_downstream.total;
+
+    Metrics& metrics = m_worker->metrics();
+    if (m_upstream.spliced()) {
+        metrics.splicedUp.add();
+    }
+    if (m_downstream.spliced()) {
+        metrics.splicedDown.add();
+    }
+
+    closeKernelPipe(m_upstream);
+    closeKernelPipe(m_downstream);
+    m_selector->removeEvents(m_clientSocket);
+    m_selector->removeEvents(m_serverSocket);
+    shutdown(m_clientSocket, SHUT_RDWR);
+    shutdown(m_serverSocket, SHUT_RDWR);
+    if (m_inflight == 0) {
+        finish();
+    }
+}
+
+
+void Connection::finish()
+{
+    ::close(m_clientSocket);
+    ::close(m_serverSocket);
+    m_worker->removeConnection(this);
+}
+
+
+void Connection::openKernelPipe(Pipe& p)
+{
+    if (pipe2(p.kpipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+        perror("pipe2");
+        p.kpipe[0] = p.kpipe[1] = -1;
+        return;
+    }
+    p.kpipeSize = fcntl(p.kpipe[0], F_GETPIPE_SZ);
+    if (p.kpipeSize <= 0) {
+        p.kpipeSize = BufferPool::MAX_SIZE;
+    }
+}
+
+
+void Connection::closeKernelPipe(Pipe& p)
+{
+    if (p.spliced()) {
+        ::close(p.kpipe[0]);
+        ::close(p.kpipe[1]);
+        p.kpipe[0] = p.kpipe[1] = -1;
+    }
+}
+
+
+void Connection::count(Pipe& p, size_t n)
+{
+    m_active = m_selector->now();
+    if (p.total == 0) {
+        (&p == &m_upstream ? m_trace.firstUp : m_trace.firstDown) = traceNow();
+    }
+    p.total += n;
+    Metrics& metrics = m_worker->metrics();
+    (&p == &m_upstream ? metrics.bytesUp : metrics.bytesDown).add(n);
+}
+
+
+void Connection::do_wait(Pipe& p)
+{
+    if (p.wantsWrite()) {
+        m_selector->addWriteEvent(p.to, [this, &p](int) { do_relay(p); });
+    } else {
+        m_selector->addReadEvent(p.from, [this, &p](int) { do_relay(p); });
+    }
+}
+
+
+void Connection::do_relay(Pipe& p)
+{
+    size_t budget = m_worker->config().relayBudget;
+    size_t start = p.received + p.total;
+    while (true)
+    {
+        size_t before = p.received + p.total;
+        p.blocked = false;
+        if (p.wantsRead() && !do_read(p)) {
+            return this->close();
+        }
+        if (p.wantsWrite() && !do_write(p)) {
+            return this->close();
+        }
+        if (p.done()) {
+            return do_shutdown(p);
+        }
+        size_t moved = p.received + p.total;
+        if (p.blocked || moved == before || moved - start >= budget) {
+            return do_wait(p);
+        }
+    }
+}
+
+
+void Connection::do_shutdown(Pipe& p)
+{
+    shutdown(p.to, SHUT_WR);
+    p.shut = true;
+    if (m_upstream.shut && m_downstream.shut) {
+        this->close();
+    }
+}
+
+
+void Connection::do_recv(Pipe& p)
+{
+    // The ring is empty here, so its free space is one segment.
+    struct iovec iov[2];
+    p.buf.space(iov);
+
+    ++m_inflight;
+    m_selector->submitRecv(p.from, iov[0].iov_base, iov[0].iov_len,
+        [this, &p](int res)
+        {
+            --m_inflight;
+            if (m_closing) {
+                if (m_inflight == 0) {
+                    finish();
+                }
+                return;
+            }
+            if (res < 0) {
+                return this->close();
+            }
+            if (res == 0) {
+                p.eof = true;
+                return do_shutdown(p);
+            }
+            m_active = m_selector->now();
+            p.buf.produced(res);
+            do_send(p);
+        });
+}
+
+
+void Connection::do_send(Pipe& p)
+{
+    struct iovec iov[2];
+    p.buf.data(iov);
+
+    ++m_inflight;
+    m_selector->submitSend(p.to, iov[0].iov_base, iov[0].iov_len,
+        [this, &p](int res)
+        {
+            --m_inflight;
+            if (m_closing) {
+                if (m_inflight == 0) {
+                    finish();
+                }
+                return;
+            }
+            if (res < 0) {
+                return this->close();
+            }
+            count(p, res);
+            p.buf.consumed(res);
+            if (!p.buf.empty()) {
+                return do_send(p);
+            }
+            do_recv(p);
+        });
+}
+
+
+bool Connection::do_read(Pipe& p)
+{
+    if (p.spliced()) {
+        return do_splice_read(p);
+    }
+
+    struct iovec iov[2];
+    int cnt = p.buf.space(iov);
+
+    ssize_t n = readv(p.from, iov, cnt);
+    if (n > 0) {
+        m_active = m_selector->now();
+        p.received += n;
+        p.buf.produced(n);
+        return true;
+    }
+    if (n == 0) {
+        p.eof = true;
+        return true;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        m_selector->wouldBlock(p.from, POLLIN);
+        p.buf.idle();
+        p.blocked = true;
+        return true;
+    }
+    return false;
+}
+
+
+bool Connection::do_write(Pipe& p)
+{
+    if (p.spliced()) {
+        return do_splice_write(p);
+    }
+
+    // sendmsg(2) rather than writev(2) for MSG_NOSIGNAL.
+    struct iovec iov[2];
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = p.buf.data(iov);
+
+    ssize_t n = sendmsg(p.to, &msg, MSG_NOSIGNAL);
+    if (n >= 0) {
+        count(p, n);
+        p.buf.consumed(n);
+        return true;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        m_selector->wouldBlock(p.to, POLLOUT);
+        p.blocked = true;
+        return true;
+    }
+    return false;
+}
+
+
+bool Connection::do_splice_read(Pipe& p)
+{
+    // The kernel pipe is empty here, so EAGAIN can only come from the
+    // socket. It takes no more than the high watermark either.
+    size_t len = std::min<size_t>(p.kpipeSize,
+                                  m_worker->buffers().highWatermark());
+    ssize_t n = splice(p.from, nullptr, p.kpipe[1], nullptr, len,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+        m_active = m_selector->now();
+        p.received += n;
+        p.len = n;
+        p.off = 0;
+        return true;
+    }
+    if (n == 0) {
+        p.eof = true;
+        return true;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        m_selector->wouldBlock(p.from, POLLIN);
+        p.blocked = true;
+        return true;
+    }
+    if (errno == EINVAL || errno == ENOSYS) {
+        closeKernelPipe(p);
+        return do_read(p);
+    }
+    return false;
+}
+
+
+bool Connection::do_splice_write(Pipe& p)
+{
+    ssize_t n = splice(p.kpipe[0], nullptr, p.to, nullptr, p.len - p.off,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n >= 0) {
+        count(p, n);
+        p.off += n;
+        if (p.off == p.len) {
+            p.len = p.off = 0;
+        }
+        return true;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        m_selector->wouldBlock(p.to, POLLOUT);
+        p.blocked = true;
+        return true;
+    }
+    return false;
+}
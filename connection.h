@@ -1,28 +1,97 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
 #include <sys/types.h>
 #include <sys/socket.h>
 
-#include "server.h"
+#include "worker.h"
 #include "selector.h"
 
 
+// Relays plain TCP in both directions at once. Each direction is a
+// Pipe with its own buffer that waits either for its source to become
+// readable or for its destination to become writable, so a socket can
+// have a read handler for one pipe and a write handler for the other.
+// The buffer is a ring from the worker's buffer pool that grows with
+// the traffic, is filled with readv(2) and drained with one sendmsg(2)
+// for both of its segments, and goes back to the pool when the source
+// has nothing to read.
+//
+// A readiness handler relays until the sockets would block, but only
+// up to the worker's byte budget per wakeup: a connection that always
+// has data then waits for the next wakeup like everybody else, and
+// the other connections of the loop get their turn in between.
+//
+// In splice mode a pipe moves the data through a kernel pipe with
+// splice(2) and never copies it to userspace. A pipe falls back to the
+// buffer if the kernel refuses to splice its socket.
+//
+// With io_uring and without splice a pipe does not wait for readiness:
+// it submits a recv into its buffer, a send of what arrived, and the
+// next recv once everything is sent. The buffer still grows, but as a
+// recv is always pending, it is only released with the connection.
+// Closing then shuts the sockets down, which completes the operations
+// still running, and the object is only destroyed after the last one.
 class Connection : public IConnection
 {
-    static const int BUFSIZE = 1024;
+    struct Pipe
+    {
+        int         from;
+        int         to;
+        RelayBuffer buf;
+        int    len  = 0;     // bytes in the kernel pipe
+        int    off  = 0;     // bytes of the kernel pipe already sent
+        bool   eof  = false; // from will not send anything else
+        bool   shut = false; // to has been shut down for writing
+        int    kpipe[2] = {-1, -1};
+        int    kpipeSize = 0;
+        size_t total = 0;
+        size_t received = 0;
+        bool   blocked = false; // an operation of this pass would block
+
+        Pipe(int from, int to, BufferPool* pool)
+            : from(from), to(to), buf(pool) {}
+
+        bool spliced() const noexcept { return kpipe[0] >= 0; }
+        bool wantsRead() const noexcept {
+            return !eof && (spliced() ? len == 0 : !buf.full());
+        }
+        bool wantsWrite() const noexcept {
+            return spliced() ? off < len : !buf.empty();
+        }
+        bool done() const noexcept { return eof && !wantsWrite(); }
+    };
 
-    Server   *m_server;
+    Worker   *m_worker;
     Selector *m_selector;
 
     int  m_clientSocket;
     int  m_serverSocket;
-    char m_buf[BUFSIZE];
-    int  m_len;
+    Pipe m_upstream;   // client -> server
+    Pipe m_downstream; // server -> client
+
+    bool m_closing  = false;
+    int  m_inflight = 0; // operations submitted to io_uring
 
 public:
-    Connection(Server* serv, Selector* sel, int clientSock, int serverSock)
-        : m_server(serv), m_selector(sel), 
-          m_clientSocket(clientSock), m_serverSocket(serverSock) 
+    Connection(Worker* worker, Selector* sel, int clientSock, int serverSock,
+               bool splice = false)
+        : m_worker(worker), m_selector(sel),
+          m_clientSocket(clientSock), m_serverSocket(serverSock),
+          m_upstream(clientSock, serverSock, &worker->buffers()),
+          m_downstream(serverSock, clientSock, &worker->buffers())
     {
-        do_read(m_clientSocket);
+        if (splice) {
+            openKernelPipe(m_upstream);
+            openKernelPipe(m_downstream);
+        }
+        if (sel->completions() && !splice) {
+            do_recv(m_upstream);
+            do_recv(m_downstream);
+        } else {
+            do_wait(m_upstream);
+            do_wait(m_downstream);
+        }
     }
 
     ~Connection() = default;
@@ -30,48 +99,22 @@ public:
     virtual void close() override;
 
 private:
-    void do_read(int sock);
-    void do_write(int sock);
-
-    int getPeer(int sock) const noexcept {
-        return sock == m_clientSocket ? m_serverSocket : m_clientSocket;
-    }
+    void do_wait(Pipe& p);
+    void do_relay(Pipe& p);
+    void do_shutdown(Pipe& p);
+
+    void do_recv(Pipe& p);
+    void do_send(Pipe& p);
+    void finish();
+
+    bool do_read(Pipe& p);
+    bool do_write(Pipe& p);
+    bool do_splice_read(Pipe& p);
+    bool do_splice_write(Pipe& p);
+    void count(Pipe& p, size_t n);
+
+    static void openKernelPipe(Pipe& p);
+    static void closeKernelPipe(Pipe& p);
 };
 
-
-void Connection::close()
-{
-    shutdown(m_clientSocket, SHUT_RDWR);
-    shutdown(m_serverSocket, SHUT_RDWR);
-    ::close(m_clientSocket);
-    ::close(m_serverSocket);
-    m_server->removeConnection(this);
-}
-
-
-void Connection::do_read(int sock)
-{
-    m_selector->addReadEvent(sock, 
-    [this](int sock) 
-    {
-        m_len = recv(sock, m_buf, BUFSIZE, 0);
-        if (m_len > 0) {
-            return do_write(getPeer(sock));
-        }
-        this->close();
-    });
-}
-
-
-void Connection::do_write(int sock)
-{
-    m_selector->addWriteEvent(sock,
-    [this](int sock)
-    {
-        m_len = send(sock, m_buf, m_len, 0);
-        if (m_len > 0) {
-            return do_read(sock);
-        }
-        this->close();
-    });
-}
\ No newline at end of file
+#endif // CONNECTION_H
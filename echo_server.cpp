@@ -1,11 +1,13 @@
 #include <iostream>
 #include <cstring>
+#include <string>
 #include <thread>
 #include <mutex>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 
 
@@ -20,14 +22,22 @@ void println(T t)
 }
 
 
-int main()
+int main(int argc, char* argv[])
 {
+    // -q stops printing every message so that the server can keep up
+    // with proxy-bench.
+    bool quiet = argc > 1 && std::string(argv[1]) == "-q";
+
+
     int server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (server_socket < 0) {
         perror("socket");
         return 1;
     }
 
+    int on = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
     struct sockaddr_in addr;
     addr.sin_family = AF_INET;
     addr.sin_port = htons(8443);
@@ -38,7 +48,7 @@ int main()
         return 2;
     }
 
-    if (listen(server_socket, 10) < 0) {
+    if (listen(server_socket, 128) < 0) {
         perror("listen");
         return 3;
     }
@@ -50,20 +60,23 @@ int main()
             perror("accept");
             break;
         }
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
 
-        std::thread th([sock]() 
+        std::thread th([sock, quiet]() 
         {
             char buf[1024];
             while(true)
             {
-                int n = read(sock, buf, 1024);
+                int n = read(sock, buf, sizeof(buf) - 1);
                 if (n <= 0) {
                     perror("read");
                     break;
                 }
 
-                buf[n] = 0;
-                println(buf);
+                if (!quiet) {
+                    buf[n] = 0;
+                    println(buf);
+                }
 
                 n = write(sock, buf, n);
                 if (n <= 0) {
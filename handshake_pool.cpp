@@ -0,0 +1,85 @@
+#include <openssl/err.h>
+
+#include "handshake_pool.h"
+
+
+HandshakePool::HandshakePool(unsigned threads)
+    : m_stop(false)
+{
+    for (unsigned i = 0; i < threads; ++i) {
+        m_threads.emplace_back([this] { run(); });
+    }
+}
+
+
+HandshakePool::~HandshakePool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wakeup.notify_all();
+    for (auto& th : m_threads) {
+        th.join();
+    }
+}
+
+
+void HandshakePool::handshake(SSL* ssl, Selector* sel, Handler h)
+{
+    Job *job = new Job();
+    job->ssl = ssl;
+    job->selector = sel;
+    job->handler = std::move(h);
+    job->queued = Clock::now();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push_back(job);
+    }
+    m_wakeup.notify_one();
+}
+
+
+void HandshakePool::run()
+{
+    while (true)
+    {
+        Job *job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wakeup.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+            // Queued steps still run when stopping, their connections
+            // wait for them to be back before they close.
+            if (m_queue.empty()) {
+                return;
+            }
+            job = m_queue.front();
+            m_queue.pop_front();
+        }
+
+        job->wait = std::chrono::duration<double>(
+            Clock::now() - job->queued).count();
+        step(*job);
+
+        // The job goes with the handler, which frees it on the loop.
+        job->selector->post([job]
+        {
+            job->handler(job->err, job->error, job->wait);
+            delete job;
+        });
+    }
+}
+
+
+void HandshakePool::step(Job& job)
+{
+    int n = SSL_do_handshake(job.ssl);
+    if (n <= 0) {
+        job.err = SSL_get_error(job.ssl, n);
+        if (job.err == SSL_ERROR_SSL) {
+            job.error = ERR_peek_error();
+        }
+    }
+    // The error queue belongs to this thread, not to the connection.
+    ERR_clear_error();
+}
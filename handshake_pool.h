@@ -0,0 +1,73 @@
+#ifndef HANDSHAKE_POOL_H
+#define HANDSHAKE_POOL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <openssl/ssl.h>
+
+#include "inplace_function.h"
+#include "selector.h"
+
+
+// Runs the steps of TLS handshakes for all the workers on a few threads
+// of its own, so that the public key crypto of a burst of new clients
+// does not hold up the connections an event loop is relaying.
+//
+// A step is one SSL_do_handshake() on the non-blocking socket: it goes
+// as far as the data that has arrived allows and is handed back with
+// SSL_ERROR_WANT_READ or SSL_ERROR_WANT_WRITE, so the loop still does
+// the waiting and a thread is never tied up by a slow peer. The result
+// is posted to the selector that asked for it, like the Resolver does.
+class HandshakePool
+{
+public:
+    // SSL_ERROR_NONE when the handshake is done, the SSL_get_error() of
+    // the step otherwise, with the first error of OpenSSL's queue for
+    // SSL_ERROR_SSL; and the seconds the step waited for a thread.
+    using Handler =
+        InplaceFunction<void (int err, unsigned long error, double wait)>;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Job
+    {
+        SSL              *ssl;
+        Selector         *selector;
+        Handler           handler;
+        Clock::time_point queued;
+        int               err   = SSL_ERROR_NONE;
+        unsigned long     error = 0;
+        double            wait  = 0;
+    };
+
+    std::mutex               m_mutex;
+    std::condition_variable  m_wakeup;
+    std::deque<Job*>         m_queue;
+    bool                     m_stop;
+    std::vector<std::thread> m_threads;
+
+public:
+    explicit HandshakePool(unsigned threads);
+    ~HandshakePool();
+
+    HandshakePool(const HandshakePool&) = delete;
+    HandshakePool& operator=(const HandshakePool&) = delete;
+
+    // Runs a handshake step on ssl and calls h on sel's loop with the
+    // result. Nothing else may use ssl until then. Steps still queued
+    // when the pool is destroyed are run and posted before its threads
+    // exit, the job is only freed by its handler.
+    void handshake(SSL* ssl, Selector* sel, Handler h);
+
+private:
+    void run();
+    static void step(Job& job);
+};
+
+#endif // HANDSHAKE_POOL_H
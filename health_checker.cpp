@@ -0,0 +1,151 @@
+#include <cerrno>
+#include <cstdio>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "health_checker.h"
+#include "ssl_connection.h"
+#include "net.h"
+
+
+HealthChecker::HealthChecker(const Config& config, Selector* sel, bool tls,
+                             Balancer* balancer, Metrics* metrics)
+    : m_config(config), m_selector(sel), m_tls(tls), m_balancer(balancer),
+      m_probes(balancer->size()), m_socketOptions(config.socketOptions),
+      m_metrics(metrics)
+{
+    // With TCP Fast Open the connect succeeds before a SYN is sent, it
+    // would not probe anything.
+    m_socketOptions.fastOpenConnect = false;
+}
+
+
+HealthChecker::~HealthChecker()
+{
+    for (auto& probe : m_probes)
+    {
+        if (probe.sock < 0) {
+            continue;
+        }
+        SSL_free(probe.ssl);
+        m_selector->removeEvents(probe.sock);
+        close(probe.sock);
+    }
+}
+
+
+void HealthChecker::start()
+{
+    for (size_t i = 0; i < m_probes.size(); ++i) {
+        do_probe(i);
+    }
+}
+
+
+void HealthChecker::do_probe(size_t i)
+{
+    m_selector->addTimer(m_config.healthInterval, [this, i] { do_probe(i); });
+
+    Probe& probe = m_probes[i];
+    if (probe.sock >= 0) {
+        return;
+    }
+
+    const Balancer::Backend& backend = (*m_balancer)[i];
+    probe.sock = createNonblockingSocket(backend.address().family());
+    if (probe.sock < 0) {
+        return;
+    }
+    // Probed like the connections are served. A probe is still sent
+    // with an option that did not take, which is told once per worker.
+    if (!tuneUpstreamSocket(probe.sock, m_socketOptions)) {
+        if (m_metrics->socketOptionErrors.value() == 0) {
+            perror("setsockopt");
+        }
+        m_metrics->socketOptionErrors.add();
+    }
+    int err = connect(probe.sock, backend.address());
+    if (err != 0 && err != EINPROGRESS) {
+        return done(i, false);
+    }
+
+    unsigned gen = probe.gen;
+    m_selector->addTimer(m_config.healthTimeout, [this, i, gen]
+    {
+        if (m_probes[i].gen == gen && m_probes[i].sock >= 0) {
+            done(i, false);
+        }
+    });
+
+    m_selector->addWriteEvent(probe.sock, [this, i](int sock)
+    {
+        if (getConnectResult(sock) != 0) {
+            return done(i, false);
+        }
+        if (!m_tls) {
+            return done(i, true);
+        }
+        try {
+            m_probes[i].ssl =
+                SSLConnection::newSSL(sock, &(*m_balancer)[i].peer);
+        }
+        catch (SSLException&) {
+            return done(i, false);
+        }
+        do_handshake(i);
+    });
+}
+
+
+void HealthChecker::do_handshake(size_t i)
+{
+    Probe& probe = m_probes[i];
+
+    int ret = SSL_connect(probe.ssl);
+    if (ret == 1) {
+        SSLConnection::handshakeDone(probe.ssl);
+        return done(i, true);
+    }
+
+    int err = SSL_get_error(probe.ssl, ret);
+    auto handler = [this, i](int) { do_handshake(i); };
+    if (err == SSL_ERROR_WANT_READ) {
+        m_selector->wouldBlock(probe.sock, POLLIN);
+        m_selector->addReadEvent(probe.sock, handler);
+    }
+    else if (err == SSL_ERROR_WANT_WRITE) {
+        m_selector->wouldBlock(probe.sock, POLLOUT);
+        m_selector->addWriteEvent(probe.sock, handler);
+    }
+    else {
+        ERR_clear_error();
+        done(i, false);
+    }
+}
+
+
+void HealthChecker::done(size_t i, bool healthy)
+{
+    Probe& probe = m_probes[i];
+
+    // A close_notify keeps the session resumable.
+    if (probe.ssl) {
+        if (healthy) {
+            SSL_shutdown(probe.ssl);
+            ERR_clear_error();
+        }
+        SSL_free(probe.ssl);
+        probe.ssl = nullptr;
+    }
+    m_selector->removeEvents(probe.sock);
+    close(probe.sock);
+    probe.sock = -1;
+    ++probe.gen;
+
+    if (healthy) {
+        m_balancer->succeeded(i);
+    } else {
+        m_balancer->failed(i);
+    }
+}
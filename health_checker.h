@@ -0,0 +1,49 @@
+#ifndef HEALTH_CHECKER_H
+#define HEALTH_CHECKER_H
+
+#include <vector>
+
+#include <openssl/ssl.h>
+
+#include "balancer.h"
+#include "config.h"
+#include "metrics.h"
+#include "selector.h"
+
+
+// Probes the backends of one worker on the loop's timers: every
+// healthInterval it connects to each one, does a TLS handshake when
+// the upstream speaks TLS, and reports the result to the balancer. A
+// probe that takes longer than healthTimeout fails. A backend still
+// being probed when the next one is due is skipped.
+class HealthChecker
+{
+    struct Probe
+    {
+        int      sock = -1;
+        SSL     *ssl  = nullptr;
+        unsigned gen  = 0; // tells a timeout of an older probe apart
+    };
+
+    const Config&      m_config;
+    Selector          *m_selector;
+    bool               m_tls;
+    Balancer          *m_balancer;
+    std::vector<Probe> m_probes; // per backend
+    SocketOptions      m_socketOptions; // of the upstream, without TFO
+    Metrics           *m_metrics;
+
+public:
+    HealthChecker(const Config& config, Selector* sel, bool tls,
+                  Balancer* balancer, Metrics* metrics);
+    ~HealthChecker();
+
+    void start();
+
+private:
+    void do_probe(size_t i);
+    void do_handshake(size_t i);
+    void done(size_t i, bool healthy);
+};
+
+#endif // HEALTH_CHECKER_H
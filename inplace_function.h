@@ -0,0 +1,130 @@
+#ifndef INPLACE_FUNCTION_H
+#define INPLACE_FUNCTION_H
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+
+// A std::function that keeps the callable inside the object instead of
+// on the heap, so arming a handler never allocates. Callables larger
+// than Capacity do not compile.
+template <typename Signature, size_t Capacity = 32>
+class InplaceFunction;
+
+template <typename R, typename... Args, size_t Capacity>
+class InplaceFunction<R (Args...), Capacity>
+{
+    struct VTable
+    {
+        R    (*call)(void* f, Args&&... args);
+        void (*copy)(void* dst, const void* src);
+        void (*move)(void* dst, void* src);
+        void (*destroy)(void* f);
+    };
+
+    template <typename F>
+    static const VTable* vtable()
+    {
+        static const VTable vt = {
+            [](void* f, Args&&... args) -> R {
+                return (*static_cast<F*>(f))(std::forward<Args>(args)...);
+            },
+            [](void* dst, const void* src) {
+                new (dst) F(*static_cast<const F*>(src));
+            },
+            [](void* dst, void* src) {
+                new (dst) F(std::move(*static_cast<F*>(src)));
+            },
+            [](void* f) {
+                static_cast<F*>(f)->~F();
+            }
+        };
+        return &vt;
+    }
+
+    alignas(std::max_align_t) unsigned char m_storage[Capacity];
+    const VTable *m_vtable = nullptr;
+
+public:
+    InplaceFunction() noexcept {}
+    InplaceFunction(std::nullptr_t) noexcept {}
+
+    template <typename F, typename = typename std::enable_if<
+        !std::is_same<typename std::decay<F>::type, InplaceFunction>::value
+        >::type>
+    InplaceFunction(F&& f)
+    {
+        using T = typename std::decay<F>::type;
+        static_assert(sizeof(T) <= Capacity, "callable is too large");
+        static_assert(alignof(T) <= alignof(std::max_align_t),
+                      "callable is over-aligned");
+        new (m_storage) T(std::forward<F>(f));
+        m_vtable = vtable<T>();
+    }
+
+    InplaceFunction(const InplaceFunction& other)
+    {
+        if (other.m_vtable) {
+            other.m_vtable->copy(m_storage, other.m_storage);
+            m_vtable = other.m_vtable;
+        }
+    }
+
+    InplaceFunction(InplaceFunction&& other) noexcept
+    {
+        if (other.m_vtable) {
+            other.m_vtable->move(m_storage, other.m_storage);
+            m_vtable = other.m_vtable;
+            other.reset();
+        }
+    }
+
+    ~InplaceFunction() {
+        reset();
+    }
+
+    InplaceFunction& operator=(const InplaceFunction& other)
+    {
+        if (this != &other) {
+            reset();
+            new (this) InplaceFunction(other);
+        }
+        return *this;
+    }
+
+    InplaceFunction& operator=(InplaceFunction&& other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            new (this) InplaceFunction(std::move(other));
+        }
+        return *this;
+    }
+
+    InplaceFunction& operator=(std::nullptr_t) noexcept
+    {
+        reset();
+        return *this;
+    }
+
+    explicit operator bool() const noexcept {
+        return m_vtable != nullptr;
+    }
+
+    R operator()(Args... args) {
+        return m_vtable->call(m_storage, std::forward<Args>(args)...);
+    }
+
+private:
+    void reset() noexcept
+    {
+        if (m_vtable) {
+            m_vtable->destroy(m_storage);
+            m_vtable = nullptr;
+        }
+    }
+};
+
+#endif // INPLACE_FUNCTION_H
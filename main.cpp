@@ -1,7 +1,11 @@
 #include <iostream>
 #include <atomic>
+#include <memory>
 #include <thread>
 #include <string>
+#include <vector>
+#include <climits>
+#include <cstdio>
 
 #include <unistd.h>
 #include <signal.h>
@@ -42,25 +46,312 @@ parsePort(std::string s)
 }
 
 
+std::tuple<int, Error>
+parseWorkers(std::string s)
+{
+    try {
+        int workers = std::stoi(s);
+        if (workers < 1 || workers > 1024) {
+            return std::make_tuple(0, "invalid number of workers");
+        }
+        return std::make_tuple(workers, Error());
+    }
+    catch (std::exception& e) {
+        return std::make_tuple(0, "invalid number of workers");
+    }
+}
+
+
+std::tuple<long, Error>
+parseNumber(std::string s, const char* error)
+{
+    try {
+        long n = std::stol(s);
+        if (n < 0) {
+            return std::make_tuple(0, error);
+        }
+        return std::make_tuple(n, Error());
+    }
+    catch (std::exception& e) {
+        return std::make_tuple(0, error);
+    }
+}
+
+
+std::tuple<size_t, size_t, long, Error>
+parsePool(std::string s)
+{
+    size_t min, max;
+    long idle = Config().poolIdleTimeout;
+    int n = 0;
+    if (sscanf(s.c_str(), "%zu:%zu%n:%ld%n", &min, &max, &n, &idle, &n) < 2
+        || n != (int) s.size() || min > max || max == 0 || idle < 0)
+    {
+        return std::make_tuple(0, 0, 0, "invalid pool");
+    }
+    return std::make_tuple(min, max, idle, Error());
+}
+
+
+// n[:ms], where ms keeps its value if it is left out.
+std::tuple<long, long, Error>
+parsePair(std::string s, long ms, const char* error)
+{
+    long n;
+    int end = 0;
+    if (sscanf(s.c_str(), "%ld%n:%ld%n", &n, &end, &ms, &end) < 1 ||
+        end != (int) s.size() || n < 0 || ms <= 0)
+    {
+        return std::make_tuple(0, 0, error);
+    }
+    return std::make_tuple(n, ms, Error());
+}
+
+
+// connect[:handshake[:idle[:lifetime]]] in milliseconds, the ones left
+// out keep their defaults.
+Error
+parseTimeouts(std::string s, Config& config)
+{
+    long *values[] = {&config.connectTimeout, &config.handshakeTimeout,
+                      &config.idleTimeout, &config.lifetime};
+    long parsed[4];
+    int end = 0;
+    int n = sscanf(s.c_str(), "%ld%n:%ld%n:%ld%n:%ld%n", &parsed[0], &end,
+                   &parsed[1], &end, &parsed[2], &end, &parsed[3], &end);
+    if (n < 1 || end != (int) s.size()) {
+        return "invalid timeouts";
+    }
+    for (int i = 0; i < n; ++i)
+    {
+        if (parsed[i] < 0) {
+            return "invalid timeouts";
+        }
+        *values[i] = parsed[i];
+    }
+    return Error();
+}
+
+
+// high[:low] in bytes, low defaults to half of high.
+std::tuple<size_t, size_t, Error>
+parseWatermarks(std::string s)
+{
+    size_t high, low;
+    int end = 0;
+    int n = sscanf(s.c_str(), "%zu%n:%zu%n", &high, &end, &low, &end);
+    if (n == 1) {
+        low = high / 2;
+    }
+    if (n < 1 || end != (int) s.size() || s[0] == '-' || high == 0 ||
+        high > BufferPool::MAX_SIZE || low >= high)
+    {
+        return std::make_tuple(0, 0, "invalid watermarks");
+    }
+    return std::make_tuple(high, low, Error());
+}
+
+
+// A comma-separated list of backlog=n, defer-accept=seconds,
+// fastopen=queue, fastopen-connect, nodelay=0|1, rcvbuf=bytes,
+// sndbuf=bytes and incoming-cpu.
+Error
+parseSocketOptions(std::string s, Config& config)
+{
+    SocketOptions& options = config.socketOptions;
+    size_t start = 0;
+    while (true)
+    {
+        size_t end = s.find(',', start);
+        std::string option = s.substr(start, end - start);
+        size_t eq = option.find('=');
+        std::string name = option.substr(0, eq);
+        long value = 1;
+        if (eq != std::string::npos) {
+            Error err;
+            std::tie(value, err) = parseNumber(option.substr(eq + 1), "");
+            if (err || value > INT_MAX) {
+                return "invalid socket option";
+            }
+        }
+
+        if (name == "backlog" && value > 0) {
+            options.backlog = value;
+        } else if (name == "defer-accept") {
+            options.deferAccept = value;
+        } else if (name == "fastopen") {
+            options.fastOpen = value;
+        } else if (name == "fastopen-connect") {
+            options.fastOpenConnect = value != 0;
+        } else if (name == "nodelay") {
+            options.noDelay = value != 0;
+        } else if (name == "rcvbuf") {
+            options.receiveBuffer = value;
+        } else if (name == "sndbuf") {
+            options.sendBuffer = value;
+        } else if (name == "incoming-cpu") {
+            config.incomingCpu = value != 0;
+        } else {
+            return "invalid socket option";
+        }
+
+        if (end == std::string::npos) {
+            return Error();
+        }
+        start = end + 1;
+    }
+}
+
+
+// A comma-separated list of connections=n, client-connections=n,
+// rate=r[:burst] and client-rate=r[:burst].
+Error
+parseAdmission(std::string s, AdmissionLimits& limits)
+{
+    size_t start = 0;
+    while (true)
+    {
+        size_t end = s.find(',', start);
+        std::string option = s.substr(start, end - start);
+        size_t eq = option.find('=');
+        if (eq == std::string::npos) {
+            return "invalid admission limit";
+        }
+        std::string name = option.substr(0, eq);
+        const char *value = option.c_str() + eq + 1;
+
+        double rate;
+        unsigned burst = 0;
+        int n = 0;
+        if (name == "rate" || name == "client-rate")
+        {
+            if (sscanf(value, "%lf%n:%u%n", &rate, &n, &burst, &n) < 1 ||
+                value[n] != '\0' || !(rate > 0) || *value == '-')
+            {
+                return "invalid admission limit";
+            }
+            if (name == "rate") {
+                limits.rate = rate;
+                limits.burst = burst;
+            } else {
+                limits.clientRate = rate;
+                limits.clientBurst = burst;
+            }
+        }
+        else if (name == "connections" || name == "client-connections")
+        {
+            auto [max, err] = parseNumber(value, "invalid admission limit");
+            if (err || max > UINT_MAX) {
+                return "invalid admission limit";
+            }
+            if (name == "connections") {
+                limits.connections = max;
+            } else {
+                limits.clientConnections = max;
+            }
+        }
+        else {
+            return "invalid admission limit";
+        }
+
+        if (end == std::string::npos) {
+            return Error();
+        }
+        start = end + 1;
+    }
+}
+
+
+// host:port, with an IPv6 host in brackets.
 std::tuple<std::string, int, Error> 
 parseAddr(std::string s)
 {
-    std::size_t colonPos = s.find(':');
-    if (colonPos == std::string::npos) {
+    std::size_t colonPos = s.rfind(':');
+    if (colonPos == std::string::npos || colonPos == 0) {
         return std::make_tuple("", 0, "invalid address");
     }
     std::string host = s.substr(0, colonPos);
+    if (host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+    } else if (host.find(':') != std::string::npos) {
+        return std::make_tuple("", 0, "invalid address");
+    }
     auto [port, err] = parsePort(s.substr(colonPos + 1));
     return std::make_tuple(host, port, err);
 }
 
 
+// A comma-separated list of host:port.
+std::tuple<std::vector<BackendAddress>, Error>
+parseBackends(std::string s)
+{
+    std::vector<BackendAddress> backends;
+    size_t start = 0;
+    while (true)
+    {
+        size_t end = s.find(',', start);
+        BackendAddress backend;
+        Error err;
+        std::tie(backend.host, backend.port, err) =
+            parseAddr(s.substr(start, end - start));
+        if (err) {
+            return std::make_tuple(backends, err);
+        }
+        backends.push_back(backend);
+        if (end == std::string::npos) {
+            return std::make_tuple(backends, Error());
+        }
+        start = end + 1;
+    }
+}
+
+
+std::tuple<Balancer::Policy, Error>
+parseBalancing(std::string s)
+{
+    if (s == "rr") {
+        return std::make_tuple(Balancer::Policy::RoundRobin, Error());
+    }
+    if (s == "least-conn") {
+        return std::make_tuple(Balancer::Policy::LeastConnections, Error());
+    }
+    if (s == "p2c") {
+        return std::make_tuple(Balancer::Policy::PowerOfTwo, Error());
+    }
+    if (s == "hash") {
+        return std::make_tuple(Balancer::Policy::ConsistentHash, Error());
+    }
+    return std::make_tuple(Balancer::Policy::RoundRobin,
+                           "invalid balancing policy");
+}
+
+
+std::tuple<Selector::Backend, Error>
+parseBackend(std::string s)
+{
+    if (s == "poll") {
+        return std::make_tuple(Selector::Backend::Poll, Error());
+    }
+    if (s == "epoll") {
+        return std::make_tuple(Selector::Backend::Epoll, Error());
+    }
+    if (s == "epoll-et") {
+        return std::make_tuple(Selector::Backend::EpollEdge, Error());
+    }
+    if (s == "io_uring") {
+        return std::make_tuple(Selector::Backend::IoUring, Error());
+    }
+    return std::make_tuple(Selector::Backend::Epoll, "invalid backend");
+}
+
+
 sigset_t configureExitSignals()
 {
     sigset_t set;
     sigemptyset(&set);
     sigaddset(&set, SIGINT);
     sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR1);
 
     struct sigaction act;
     act.sa_handler = [](int) {};
@@ -69,81 +360,311 @@ sigset_t configureExitSignals()
 
     sigaction(SIGINT, &act, nullptr);
     sigaction(SIGTERM, &act, nullptr);
+    sigaction(SIGUSR1, &act, nullptr);
+
+    // OpenSSL writes to the sockets without MSG_NOSIGNAL, a peer that
+    // went away must not kill the proxy.
+    signal(SIGPIPE, SIG_IGN);
+
+    // Only the main thread waits for the signals, threads started
+    // afterwards inherit the mask.
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
 
     return set;
 }
 
 
 void printUsage() {
-    std::cerr << "Usage: <-b port> <-i addr> [-s]" << std::endl;
+    std::cerr << "Usage: [-a listen-addr] <-b port> "
+                 "<-i host:port[,host:port...]>... [-D dns-ttl]\n"
+                 "       [-L rr|least-conn|p2c|hash]\n"
+                 "       [-E failures[:backoff-ms]] [-r retries] "
+                 "[-H interval-ms[:timeout-ms]]\n"
+                 "       [-T connect-ms[:handshake-ms[:idle-ms[:lifetime-ms]]]]\n"
+                 "       [-w high-watermark[:low-watermark]] "
+                 "[-B relay-budget] [-A accept-batch]\n"
+                 "       [-S option[=value][,option[=value]...]]\n"
+                 "       [-M limit=value[,limit=value...]]\n"
+                 "       [-s [-k]] [-z] [-t workers] "
+                 "[-e poll|epoll|epoll-et|io_uring]\n"
+                 "       [-O handshake-threads] [-G drain-ms] [-R restart-path]\n"
+                 "       [-c session-cache-size] [-l session-lifetime] "
+                 "[-p pool-min:pool-max[:idle-timeout]]\n"
+                 "       [-m metrics-port] [-x trace-size] "
+                 "[-C cert-file -K key-file]"
+              << std::endl;
 }
 
 
 int main(int argc, char* argv[])
 {
 
-    int portToListen = 0;
-    std::string host = "";
-    int port         = 0;
-    bool enableSSL   = false;
+    Config config;
+    bool enableSSL = false;
 
     int opt;
+    long n;
+    std::vector<BackendAddress> backends;
     Error err;
-    while((opt = getopt(argc, argv, "b:i:sh")) != -1) 
+    while((opt = getopt(argc, argv, "a:b:i:D:L:E:r:H:T:w:B:A:S:M:G:R:ske:zt:O:c:l:p:m:x:C:K:h")) != -1) 
     {
         switch (opt) {
         case 'h':
             printUsage();
             exit(EXIT_SUCCESS);
+        case 'a':
+            config.listenAddress = optarg;
+            break;
         case 'b':
-            std::tie(portToListen, err) = parsePort(optarg);
+            std::tie(config.portToListen, err) = parsePort(optarg);
             if (err) {
                 std::cout << argv[0] << ": " << err.string() << std::endl;
                 exit(EXIT_FAILURE);
             }
             break;
         case 'i':
-            std::tie(host, port, err) = parseAddr(optarg);
+            std::tie(backends, err) = parseBackends(optarg);
             if (err) {
                 std::cout << argv[0] << ": " << err.string() << std::endl;
                 exit(EXIT_FAILURE);
             }
+            config.backends.insert(config.backends.end(),
+                                   backends.begin(), backends.end());
+            break;
+        case 'D':
+            std::tie(config.dnsTtl, err) = parseNumber(optarg, "invalid ttl");
+            if (err) {
+                std::cout << argv[0] << ": " << err.string() << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'L':
+            std::tie(config.balancing, err) = parseBalancing(optarg);
+            if (err) {
+                std::cout << argv[0] << ": " << err.string() << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'E':
+            std::tie(n, config.ejectBackoff, err) =
+                parsePair(optarg, config.ejectBackoff, "invalid ejection");
+            if (err) {
+                std::cout << argv[0] << ": " << err.string() << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            config.ejectFailures = n;
+            break;
+        case 'r':
+            std::tie(n, err) = parseNumber(optarg, "invalid retries");
+            if (err) {
+                std::cout << argv[0] << ": " << err.string() << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            config.connectRetries = n;
+            break;
+        case 'H':
+            std::tie(config.healthInterval, config.healthTimeout, err) =
+                parsePair(optarg, config.healthTimeout,
+                          "invalid health check");
+            if (err || config.healthInterval == 0) {
+                std::cout << argv[0] << ": invalid health check" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'T':
+            err = parseTimeouts(optarg, config);
+            if (err) {
+                std::cout << argv[0] << ": " << err.string() << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'w':
+            std::tie(config.highWatermark, config.lowWatermark, err) =
+                parseWatermarks(optarg);
+            if (err) {
+                std::cout << argv[0] << ": " << err.string() << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'B':
+            std::tie(n, err) = parseNumber(optarg, "invalid relay budget");
+            if (err || n == 0) {
+                std::cout << argv[0] << ": invalid relay budget" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            config.relayBudget = n;
+            break;
+        case 'A':
+            std::tie(n, err) = parseNumber(optarg, "invalid accept batch");
+            if (err || n == 0 || n > 1024) {
+                std::cout << argv[0] << ": invalid accept batch" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            config.acceptBatch = n;
+            break;
+        case 'S':
+            err = parseSocketOptions(optarg, config);
+            if (err) {
+                std::cout << argv[0] << ": " << err.string() << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'M':
+            err = parseAdmission(optarg, config.admission);
+            if (err) {
+                std::cout << argv[0] << ": " << err.string() << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'G':
+            std::tie(config.drainTimeout, err) =
+                parseNumber(optarg, "invalid drain timeout");
+            if (err) {
+                std::cout << argv[0] << ": " << err.string() << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'R':
+            config.restartPath = optarg;
             break;
         case 's':
             enableSSL = true;
             break;
+        case 'k':
+            config.ktls = true;
+            break;
+        case 't':
+            std::tie(config.workers, err) = parseWorkers(optarg);
+            if (err) {
+                std::cout << argv[0] << ": " << err.string() << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'O':
+            std::tie(n, err) = parseNumber(optarg, "invalid handshake threads");
+            if (err || n > 256) {
+                std::cout << argv[0] << ": invalid handshake threads"
+                          << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            config.handshakeThreads = n;
+            break;
+        case 'c':
+            std::tie(n, err) = parseNumber(optarg, "invalid cache size");
+            if (err) {
+                std::cout << argv[0] << ": " << err.string() << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            config.sessionCacheSize = n;
+            break;
+        case 'l':
+            std::tie(n, err) = parseNumber(optarg, "invalid lifetime");
+            if (err) {
+                std::cout << argv[0] << ": " << err.string() << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            config.sessionLifetime = n;
+            break;
+        case 'p':
+            std::tie(config.poolMin, config.poolMax, config.poolIdleTimeout,
+                     err) = parsePool(optarg);
+            if (err) {
+                std::cout << argv[0] << ": " << err.string() << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'z':
+            config.splice = true;
+            break;
+        case 'C':
+            config.certFile = optarg;
+            break;
+        case 'K':
+            config.keyFile = optarg;
+            break;
+        case 'm':
+            std::tie(config.metricsPort, err) = parsePort(optarg);
+            if (err) {
+                std::cout << argv[0] << ": " << err.string() << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'x':
+            std::tie(n, err) = parseNumber(optarg, "invalid trace size");
+            if (err || n > (1 << 24)) {
+                std::cout << argv[0] << ": invalid trace size" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            config.traceSize = n;
+            break;
+        case 'e':
+            std::tie(config.backend, err) = parseBackend(optarg);
+            if (err) {
+                std::cout << argv[0] << ": " << err.string() << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
         default:
             exit(EXIT_FAILURE);
         }
     }
 
-    if (portToListen == -1 || host == "") {
+    // kTLS is for the upstream TLS of -s, and incoming-cpu steers
+    // clients between the listeners of the workers.
+    if (config.portToListen == -1 || config.backends.empty() ||
+        config.certFile.empty() != config.keyFile.empty() ||
+        (config.ktls && !enableSSL) ||
+        (config.incomingCpu && config.workers < 2))
+    {
         printUsage();
         exit(EXIT_FAILURE);
     }
 
-    Server server(portToListen, host, port);
-
+    // Before the Server, whose resolver and handshake threads have to
+    // inherit the mask.
     sigset_t set = configureExitSignals();
 
-    std::thread th([&server, enableSSL] {
+    std::unique_ptr<Server> server;
+    try {
+        server.reset(new Server(config));
+    }
+    catch (ServerException& e) {
+        std::cerr << e.what() << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    std::atomic<bool> done(false);
+    std::thread th([&server, &done, enableSSL] {
         try {
             if (enableSSL) {
-                server.listenAndServeTLS("certs/rootCA.crt");
+                server->listenAndServeTLS("certs/rootCA.crt");
             } else {
-                server.listenAndServe();
+                server->listenAndServe();
             }
         }
         catch (ServerException& e) {
             std::cerr << e.what() << std::endl;
         }
+        done = true;
         kill(getpid(), SIGTERM);
     });
 
-    int sig;
-    sigwait(&set, &sig);
+    // SIGUSR1 dumps the latency traces to stdout. The first other
+    // signal lets the connections finish, a second one cuts them.
+    auto wait = [&set, &server]
+    {
+        int sig;
+        while (sigwait(&set, &sig) == 0 && sig == SIGUSR1) {
+            server->dumpTraces(std::cout);
+        }
+    };
+    wait();
+    if (!done) {
+        server->drain();
+        wait();
+    }
 
-    server.shutdown();
+    server->shutdown();
     th.join();
 
     return 0;
@@ -0,0 +1,267 @@
+#include <cinttypes>
+#include <cstdio>
+
+#include "metrics.h"
+
+
+static const double LATENCY_BOUNDS[] = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+    0.05, 0.1, 0.25, 0.5, 1, 2.5, 5
+};
+
+static const double COUNT_BOUNDS[] = {
+    1, 2, 4, 8, 16, 32, 64, 128, 256
+};
+
+template <typename T, size_t N>
+static constexpr size_t size(const T (&)[N]) { return N; }
+
+
+Histogram::Histogram(const double* bounds, size_t size) noexcept
+    : m_bounds(bounds), m_size(size < MAX_BUCKETS ? size : MAX_BUCKETS) {}
+
+
+void Histogram::observe(double value) noexcept
+{
+    size_t i = 0;
+    while (i < m_size && value > m_bounds[i]) {
+        ++i;
+    }
+    m_buckets[i].add();
+    m_count.add();
+    m_sum.store(m_sum.load(std::memory_order_relaxed) + value,
+                std::memory_order_relaxed);
+}
+
+
+Metrics::Metrics() noexcept
+    : connectLatency(LATENCY_BOUNDS, size(LATENCY_BOUNDS)),
+      handshakeLatency(LATENCY_BOUNDS, size(LATENCY_BOUNDS)),
+      clientHandshakeLatency(LATENCY_BOUNDS, size(LATENCY_BOUNDS)),
+      handshakeQueueWait(LATENCY_BOUNDS, size(LATENCY_BOUNDS)),
+      handlersPerWakeup(COUNT_BOUNDS, size(COUNT_BOUNDS)) {}
+
+
+static void header(std::string& out, const char* name, const char* type,
+                   const char* help)
+{
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+
+static void sample(std::string& out, const char* name, const char* labels,
+                   double value)
+{
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s%s %.10g\n", name, labels, value);
+    out += buf;
+}
+
+
+template <typename Get>
+static void writeCounter(std::string& out, const char* name,
+                         const char* help,
+                         const std::vector<const Metrics*>& all, Get get)
+{
+    uint64_t value = 0;
+    for (auto m : all) {
+        value += get(*m).value();
+    }
+    header(out, name, "counter", help);
+    sample(out, name, "", value);
+}
+
+
+template <typename Get>
+static void writeHistogram(std::string& out, const char* name,
+                           const char* help,
+                           const std::vector<const Metrics*>& all, Get get)
+{
+    if (all.empty()) {
+        return;
+    }
+    const Histogram& first = get(*all.front());
+
+    header(out, name, "histogram", help);
+
+    std::string bucket = std::string(name) + "_bucket";
+    uint64_t cumulative = 0;
+    double sum = 0;
+    for (size_t i = 0; i <= first.size(); ++i)
+    {
+        for (auto m : all) {
+            cumulative += get(*m).bucket(i);
+        }
+
+        char labels[64];
+        if (i < first.size()) {
+            snprintf(labels, sizeof(labels), "{le=\"%g\"}", first.bound(i));
+        } else {
+            snprintf(labels, sizeof(labels), "{le=\"+Inf\"}");
+        }
+        sample(out, bucket.c_str(), labels, cumulative);
+    }
+    for (auto m : all) {
+        sum += get(*m).sum();
+    }
+    sample(out, (std::string(name) + "_sum").c_str(), "", sum);
+    sample(out, (std::string(name) + "_count").c_str(), "", cumulative);
+}
+
+
+void writeMetrics(std::string& out, const std::vector<const Metrics*>& all)
+{
+    writeCounter(out, "ssl_proxy_accepted_connections_total",
+                 "Client connections accepted.",
+                 all, [](const Metrics& m) -> auto& { return m.accepted; });
+
+    header(out, "ssl_proxy_rejected_connections_total", "counter",
+           "Clients turned away on accept.");
+    uint64_t rejected[5] = {};
+    for (auto m : all) {
+        rejected[0] += m->rejectedConnections.value();
+        rejected[1] += m->rejectedClientConnections.value();
+        rejected[2] += m->rejectedRate.value();
+        rejected[3] += m->rejectedClientRate.value();
+        rejected[4] += m->shedConnections.value();
+    }
+    sample(out, "ssl_proxy_rejected_connections_total",
+           "{reason=\"connections\"}", rejected[0]);
+    sample(out, "ssl_proxy_rejected_connections_total",
+           "{reason=\"client_connections\"}", rejected[1]);
+    sample(out, "ssl_proxy_rejected_connections_total",
+           "{reason=\"rate\"}", rejected[2]);
+    sample(out, "ssl_proxy_rejected_connections_total",
+           "{reason=\"client_rate\"}", rejected[3]);
+    sample(out, "ssl_proxy_rejected_connections_total",
+           "{reason=\"descriptors\"}", rejected[4]);
+
+    // Closed first, so that a connection opened in between does not
+    // make the difference negative.
+    uint64_t active = 0;
+    for (auto m : all) {
+        uint64_t closed = m->connectionsClosed.value();
+        active += m->connectionsOpened.value() - closed;
+    }
+    header(out, "ssl_proxy_active_connections", "gauge",
+           "Client connections being relayed.");
+    sample(out, "ssl_proxy_active_connections", "", active);
+
+    writeCounter(out, "ssl_proxy_upstream_connect_errors_total",
+                 "Upstream connects that failed.",
+                 all, [](const Metrics& m) -> auto& { return m.connectErrors; });
+    writeCounter(out, "ssl_proxy_connection_errors_total",
+                 "Connections that could not be set up after the connect.",
+                 all, [](const Metrics& m) -> auto& { return m.connectionErrors; });
+    writeCounter(out, "ssl_proxy_socket_option_errors_total",
+                 "Sockets of connections that did not take their options.",
+                 all, [](const Metrics& m) -> auto& { return m.socketOptionErrors; });
+    writeCounter(out, "ssl_proxy_upstream_connect_retries_total",
+                 "Failed upstream connects retried on another backend.",
+                 all, [](const Metrics& m) -> auto& { return m.connectRetries; });
+    writeCounter(out, "ssl_proxy_backend_ejections_total",
+                 "Backends ejected after consecutive failures.",
+                 all, [](const Metrics& m) -> auto& { return m.backendEjections; });
+
+    header(out, "ssl_proxy_timeouts_total", "counter",
+           "Upstream connects, TLS handshakes and connections timed out.");
+    uint64_t timeouts[4] = {};
+    for (auto m : all) {
+        timeouts[0] += m->connectTimeouts.value();
+        timeouts[1] += m->handshakeTimeouts.value();
+        timeouts[2] += m->idleTimeouts.value();
+        timeouts[3] += m->lifetimeTimeouts.value();
+    }
+    sample(out, "ssl_proxy_timeouts_total", "{kind=\"connect\"}", timeouts[0]);
+    sample(out, "ssl_proxy_timeouts_total", "{kind=\"handshake\"}", timeouts[1]);
+    sample(out, "ssl_proxy_timeouts_total", "{kind=\"idle\"}", timeouts[2]);
+    sample(out, "ssl_proxy_timeouts_total", "{kind=\"lifetime\"}", timeouts[3]);
+
+    header(out, "ssl_proxy_dns_lookups_total", "counter",
+           "Lookups of backend host names.");
+    uint64_t lookups = 0, lookupErrors = 0;
+    for (auto m : all) {
+        lookups += m->dnsLookups.value();
+        lookupErrors += m->dnsErrors.value();
+    }
+    sample(out, "ssl_proxy_dns_lookups_total", "{result=\"ok\"}", lookups);
+    sample(out, "ssl_proxy_dns_lookups_total", "{result=\"error\"}",
+           lookupErrors);
+
+    uint64_t up = 0, down = 0;
+    for (auto m : all) {
+        up += m->bytesUp.value();
+        down += m->bytesDown.value();
+    }
+    header(out, "ssl_proxy_relayed_bytes_total", "counter",
+           "Bytes relayed in each direction.");
+    sample(out, "ssl_proxy_relayed_bytes_total", "{direction=\"upstream\"}", up);
+    sample(out, "ssl_proxy_relayed_bytes_total", "{direction=\"downstream\"}",
+           down);
+
+    up = down = 0;
+    for (auto m : all) {
+        up += m->splicedUp.value();
+        down += m->splicedDown.value();
+    }
+    header(out, "ssl_proxy_spliced_connections_total", "counter",
+           "Plain connections relayed through a kernel pipe with splice(2).");
+    sample(out, "ssl_proxy_spliced_connections_total",
+           "{direction=\"upstream\"}", up);
+    sample(out, "ssl_proxy_spliced_connections_total",
+           "{direction=\"downstream\"}", down);
+
+    writeHistogram(out, "ssl_proxy_upstream_connect_seconds",
+                   "Time to connect to the upstream.",
+                   all, [](const Metrics& m) -> auto& { return m.connectLatency; });
+    writeHistogram(out, "ssl_proxy_tls_handshake_seconds",
+                   "Time of upstream TLS handshakes.",
+                   all, [](const Metrics& m) -> auto& { return m.handshakeLatency; });
+    writeHistogram(out, "ssl_proxy_client_tls_handshake_seconds",
+                   "Time of TLS handshakes with clients.",
+                   all, [](const Metrics& m) -> auto& { return m.clientHandshakeLatency; });
+
+    writeCounter(out, "ssl_proxy_tls_handshake_offloads_total",
+                 "TLS handshake steps run on the handshake threads.",
+                 all, [](const Metrics& m) -> auto& { return m.handshakesOffloaded; });
+    uint64_t queued = 0;
+    for (auto m : all) {
+        uint64_t returned = m->handshakesReturned.value();
+        queued += m->handshakesOffloaded.value() - returned;
+    }
+    header(out, "ssl_proxy_tls_handshake_queue_depth", "gauge",
+           "TLS handshake steps queued or running on the handshake threads.");
+    sample(out, "ssl_proxy_tls_handshake_queue_depth", "", queued);
+    writeHistogram(out, "ssl_proxy_tls_handshake_queue_wait_seconds",
+                   "Time TLS handshake steps waited for a handshake thread.",
+                   all, [](const Metrics& m) -> auto& { return m.handshakeQueueWait; });
+
+    header(out, "ssl_proxy_ktls_connections_total", "counter",
+           "Upstream TLS connections the kernel encrypts or decrypts.");
+    uint64_t tx = 0, rx = 0;
+    for (auto m : all) {
+        tx += m->ktlsSend.value();
+        rx += m->ktlsRecv.value();
+    }
+    sample(out, "ssl_proxy_ktls_connections_total", "{direction=\"tx\"}", tx);
+    sample(out, "ssl_proxy_ktls_connections_total", "{direction=\"rx\"}", rx);
+
+    writeCounter(out, "ssl_proxy_client_tls_resumed_total",
+                 "Client TLS handshakes that resumed a session.",
+                 all, [](const Metrics& m) -> auto& { return m.clientResumed; });
+
+    writeCounter(out, "ssl_proxy_loop_iterations_total",
+                 "Event loop wakeups.",
+                 all, [](const Metrics& m) -> auto& { return m.iterations; });
+    writeHistogram(out, "ssl_proxy_handlers_per_wakeup",
+                   "Handlers run per event loop wakeup.",
+                   all, [](const Metrics& m) -> auto& { return m.handlersPerWakeup; });
+}
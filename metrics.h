@@ -0,0 +1,113 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+// A counter written by one thread only. Updates are a relaxed load and
+// store rather than a locked read-modify-write, so they cost about as
+// much as a plain increment; other threads may read at any time.
+class Counter
+{
+    std::atomic<uint64_t> m_value{0};
+
+public:
+    void add(uint64_t n = 1) noexcept {
+        m_value.store(m_value.load(std::memory_order_relaxed) + n,
+                      std::memory_order_relaxed);
+    }
+
+    uint64_t value() const noexcept {
+        return m_value.load(std::memory_order_relaxed);
+    }
+};
+
+
+// A single-writer histogram over fixed bucket bounds, which have to
+// outlive it. Bucket counts are not cumulative, the exporter sums them.
+class Histogram
+{
+public:
+    static const size_t MAX_BUCKETS = 16;
+
+private:
+    const double       *m_bounds;
+    size_t              m_size;
+    Counter             m_buckets[MAX_BUCKETS + 1]; // the last one is +Inf
+    Counter             m_count;
+    std::atomic<double> m_sum{0};
+
+public:
+    Histogram(const double* bounds, size_t size) noexcept;
+
+    void observe(double value) noexcept;
+
+    size_t size() const noexcept { return m_size; }
+    double bound(size_t i) const noexcept { return m_bounds[i]; }
+    uint64_t bucket(size_t i) const noexcept { return m_buckets[i].value(); }
+    uint64_t count() const noexcept { return m_count.value(); }
+    double sum() const noexcept {
+        return m_sum.load(std::memory_order_relaxed);
+    }
+};
+
+
+// Everything one worker measures. Every worker owns its own instance
+// on its own cache lines, and only the metrics endpoint reads them all.
+struct alignas(64) Metrics
+{
+    using Clock = std::chrono::steady_clock;
+
+    Counter accepted;
+    Counter rejectedConnections;       // over the open connections limit
+    Counter rejectedClientConnections; // over it for the client
+    Counter rejectedRate;              // over the connection rate
+    Counter rejectedClientRate;        // over it for the client
+    Counter shedConnections;           // accepted without descriptors
+    Counter connectionsOpened;
+    Counter connectionsClosed;
+    Counter connectErrors;
+    Counter connectionErrors; // connections that could not be set up
+    Counter socketOptionErrors; // options of -S a socket did not take
+    Counter connectRetries;   // connects tried again on another backend
+    Counter backendEjections;
+    Counter connectTimeouts;
+    Counter handshakeTimeouts;
+    Counter idleTimeouts;
+    Counter lifetimeTimeouts; // connections open longer than allowed
+    Counter dnsLookups;       // of backend host names
+    Counter dnsErrors;
+    Counter bytesUp;   // client -> server
+    Counter bytesDown; // server -> client
+    Counter splicedUp; // plain connections relayed with splice(2)
+    Counter splicedDown;
+    Counter iterations;
+    Counter clientResumed;
+    Counter ktlsSend; // upstream connections with kernel TLS
+    Counter ktlsRecv;
+    Counter handshakesOffloaded; // steps run on the handshake threads
+    Counter handshakesReturned;
+
+    Histogram connectLatency;         // seconds
+    Histogram handshakeLatency;       // seconds, to the upstream
+    Histogram clientHandshakeLatency; // seconds, terminated TLS
+    Histogram handshakeQueueWait;     // seconds, for a handshake thread
+    Histogram handlersPerWakeup;
+
+    Metrics() noexcept;
+
+    static double since(Clock::time_point start) noexcept {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+};
+
+
+// Appends the sum of all metrics in the Prometheus text format.
+void writeMetrics(std::string& out, const std::vector<const Metrics*>& all);
+
+#endif // METRICS_H
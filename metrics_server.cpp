@@ -0,0 +1,143 @@
+#include <cerrno>
+#include <cstdio>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "metrics_server.h"
+#include "net.h"
+
+
+MetricsServer::MetricsServer(std::vector<const Metrics*> metrics,
+                             std::vector<const TraceRing*> traces,
+                             std::vector<std::string> backends)
+    : m_metrics(std::move(metrics)), m_traces(std::move(traces)),
+      m_backends(std::move(backends)), m_selector(Selector::Backend::Poll),
+      m_listener(-1) {}
+
+
+bool MetricsServer::listenAndServe(int port)
+{
+    SocketOptions options;
+    options.backlog = BACKLOG;
+    m_listener = createServerSocket("127.0.0.1", port, false, options);
+    if (m_listener < 0) {
+        return false;
+    }
+
+    do_accept();
+    m_selector.run();
+
+    while (!m_clients.empty()) {
+        close(*m_clients.begin());
+    }
+    m_selector.removeEvents(m_listener);
+    ::close(m_listener);
+    return true;
+}
+
+
+void MetricsServer::shutdown() {
+    m_selector.stop();
+}
+
+
+void MetricsServer::do_accept()
+{
+    m_selector.addReadEvent(m_listener, [this](int)
+    {
+        int sock = accept4(m_listener, nullptr, nullptr, SOCK_NONBLOCK);
+        if (sock < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return do_accept();
+        }
+        Client *client = new Client(sock);
+        m_clients.insert(client);
+        do_read(client);
+        do_accept();
+    });
+}
+
+
+void MetricsServer::do_read(Client* client)
+{
+    m_selector.addReadEvent(client->sock, [this, client](int sock)
+    {
+        char buf[1024];
+        int n = recv(sock, buf, sizeof(buf), 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return do_read(client);
+        }
+        if (n <= 0) {
+            return close(client);
+        }
+
+        client->in.append(buf, n);
+        if (client->in.find("\r\n\r\n") != std::string::npos ||
+            client->in.size() >= MAX_REQUEST)
+        {
+            return respond(client);
+        }
+        do_read(client);
+    });
+}
+
+
+void MetricsServer::respond(Client* client)
+{
+    const char *status = "200 OK";
+    const char *type = "text/plain; version=0.0.4";
+    std::string body;
+    if (client->in.compare(0, 13, "GET /metrics ") == 0 ||
+        client->in.compare(0, 14, "GET /metrics?") == 0)
+    {
+        writeMetrics(body, m_metrics);
+    }
+    else if (client->in.compare(0, 11, "GET /trace ") == 0) {
+        type = "application/x-ndjson";
+        writeTraces(body, m_traces, m_backends);
+    } else {
+        status = "404 Not Found";
+        body = "not found\n";
+    }
+
+    client->out = std::string("HTTP/1.0 ") + status + "\r\n"
+        "Content-Type: " + type + "\r\n"
+        "Content-Length: " + std::to_string(body.size()) + "\r\n"
+        "Connection: close\r\n\r\n" + body;
+    do_write(client);
+}
+
+
+void MetricsServer::do_write(Client* client)
+{
+    m_selector.addWriteEvent(client->sock, [this, client](int sock)
+    {
+        int n = send(sock, client->out.data() + client->off,
+                     client->out.size() - client->off, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return do_write(client);
+        }
+        if (n < 0) {
+            return close(client);
+        }
+
+        client->off += n;
+        if (client->off < client->out.size()) {
+            return do_write(client);
+        }
+        close(client);
+    });
+}
+
+
+void MetricsServer::close(Client* client)
+{
+    m_selector.removeEvents(client->sock);
+    ::shutdown(client->sock, SHUT_RDWR);
+    ::close(client->sock);
+    m_clients.erase(client);
+    delete client;
+}
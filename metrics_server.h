@@ -0,0 +1,61 @@
+#ifndef METRICS_SERVER_H
+#define METRICS_SERVER_H
+
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "metrics.h"
+#include "selector.h"
+#include "trace.h"
+
+
+// Serves GET /metrics in the Prometheus text format on a port of the
+// loopback interface, and GET /trace with the latency traces of the
+// last closed connections as JSON lines. It runs its own event loop on
+// its own thread, so a scrape only costs the workers the relaxed loads
+// of their counters.
+class MetricsServer
+{
+    static const int BACKLOG = 16;
+    static const size_t MAX_REQUEST = 4096;
+
+    struct Client
+    {
+        int         sock;
+        std::string in;
+        std::string out;
+        size_t      off = 0;
+
+        explicit Client(int sock) : sock(sock) {}
+    };
+
+    std::vector<const Metrics*>   m_metrics;
+    std::vector<const TraceRing*> m_traces;
+    std::vector<std::string>      m_backends; // names in the traces
+
+    Selector m_selector;
+    int      m_listener;
+
+    std::unordered_set<Client*> m_clients;
+
+public:
+    MetricsServer(std::vector<const Metrics*> metrics,
+                  std::vector<const TraceRing*> traces,
+                  std::vector<std::string> backends);
+    ~MetricsServer() = default;
+
+    // Returns false if it cannot listen on port.
+    bool listenAndServe(int port);
+    void shutdown();
+
+private:
+    void do_accept();
+    void do_read(Client* client);
+    void do_write(Client* client);
+
+    void respond(Client* client);
+    void close(Client* client);
+};
+
+#endif // METRICS_SERVER_H
@@ -0,0 +1,230 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#include "net.h"
+
+
+bool Address::operator==(const Address& other) const noexcept
+{
+    return len == other.len && memcmp(&storage, &other.storage, len) == 0;
+}
+
+
+std::string Address::string() const
+{
+    char host[INET6_ADDRSTRLEN];
+    char buf[INET6_ADDRSTRLEN + 16];
+    if (family() == AF_INET6) {
+        auto in6 = reinterpret_cast<const struct sockaddr_in6*>(&storage);
+        inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+        snprintf(buf, sizeof(buf), "[%s]:%d", host, ntohs(in6->sin6_port));
+    } else if (family() == AF_INET) {
+        auto in = reinterpret_cast<const struct sockaddr_in*>(&storage);
+        inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+        snprintf(buf, sizeof(buf), "%s:%d", host, ntohs(in->sin_port));
+    } else {
+        return "-";
+    }
+    return buf;
+}
+
+
+int createNonblockingSocket(int family)
+{
+    int sock = socket(family, SOCK_STREAM, 0);
+    if (sock == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    if (fcntl(sock, F_SETFL, O_NONBLOCK) != 0) {
+        perror("fcntl");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+
+static bool setOption(int sock, int level, int name, int value)
+{
+    return setsockopt(sock, level, name, &value, sizeof(value)) == 0;
+}
+
+
+// What an accepted socket inherits from its listener.
+static bool tuneInherited(int sock, const SocketOptions& options)
+{
+    return (!options.noDelay ||
+            setOption(sock, IPPROTO_TCP, TCP_NODELAY, 1)) &&
+           (options.receiveBuffer == 0 ||
+            setOption(sock, SOL_SOCKET, SO_RCVBUF, options.receiveBuffer)) &&
+           (options.sendBuffer == 0 ||
+            setOption(sock, SOL_SOCKET, SO_SNDBUF, options.sendBuffer));
+}
+
+
+int createServerSocket(const char* host, int port, bool reusePort,
+                       const SocketOptions& options, int cpu)
+{
+    std::vector<Address> addrs;
+    int err = resolveAddresses(host, port, addrs);
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+        return -1;
+    }
+    const Address& addr = addrs.front();
+
+    int sock = createNonblockingSocket(addr.family());
+    if (sock < 0) {
+        return -1;
+    }
+
+    // The wildcard takes IPv4 clients too, as IPv4-mapped addresses,
+    // whatever net.ipv6.bindv6only says.
+    auto in6 = reinterpret_cast<const struct sockaddr_in6*>(addr.get());
+    bool wildcard6 = addr.family() == AF_INET6 &&
+                     IN6_IS_ADDR_UNSPECIFIED(&in6->sin6_addr);
+
+    // The buffer sizes go before listen(2), the window scale of the
+    // handshake depends on them.
+    if (!setOption(sock, SOL_SOCKET, SO_REUSEADDR, 1) ||
+        (reusePort && !setOption(sock, SOL_SOCKET, SO_REUSEPORT, 1)) ||
+        (wildcard6 && !setOption(sock, IPPROTO_IPV6, IPV6_V6ONLY, 0)) ||
+        (cpu >= 0 && !setOption(sock, SOL_SOCKET, SO_INCOMING_CPU, cpu)) ||
+        !tuneInherited(sock, options))
+    {
+        perror("setsockopt");
+        close(sock);
+        return -1;
+    }
+
+    if (bind(sock, addr.get(), addr.len) < 0) {
+        perror("bind");
+        close(sock);
+        return -1;
+    }
+
+    if ((options.deferAccept > 0 &&
+         !setOption(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                    options.deferAccept)) ||
+        (options.fastOpen > 0 &&
+         !setOption(sock, IPPROTO_TCP, TCP_FASTOPEN, options.fastOpen)))
+    {
+        perror("setsockopt");
+        close(sock);
+        return -1;
+    }
+
+    if (listen(sock, options.backlog) < 0) {
+        perror("listen");
+        close(sock);
+        return -1;
+    } 
+
+    return sock;
+}
+
+
+bool tuneUpstreamSocket(int sock, const SocketOptions& options)
+{
+    return tuneInherited(sock, options) &&
+           (!options.fastOpenConnect ||
+            setOption(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1));
+}
+
+
+bool makeAddress(const char* host, int port, Address& addr)
+{
+    memset(&addr.storage, 0, sizeof(addr.storage));
+
+    auto in = reinterpret_cast<struct sockaddr_in*>(&addr.storage);
+    if (inet_pton(AF_INET, host, &in->sin_addr) == 1) {
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+        addr.len = sizeof(*in);
+        return true;
+    }
+
+    auto in6 = reinterpret_cast<struct sockaddr_in6*>(&addr.storage);
+    if (inet_pton(AF_INET6, host, &in6->sin6_addr) == 1) {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+        addr.len = sizeof(*in6);
+        return true;
+    }
+
+    addr.len = 0;
+    return false;
+}
+
+
+int resolveAddresses(const char* host, int port,
+                     std::vector<Address>& addrs)
+{
+    addrs.clear();
+    Address addr;
+    if (makeAddress(host, port, addr)) {
+        addrs.push_back(addr);
+        return 0;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+
+    struct addrinfo *result;
+    int err = getaddrinfo(host, service, &hints, &result);
+    if (err != 0) {
+        return err;
+    }
+    for (struct addrinfo *ai = result; ai; ai = ai->ai_next)
+    {
+        if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6) {
+            continue;
+        }
+        memset(&addr.storage, 0, sizeof(addr.storage));
+        memcpy(&addr.storage, ai->ai_addr, ai->ai_addrlen);
+        addr.len = ai->ai_addrlen;
+        addrs.push_back(addr);
+    }
+    freeaddrinfo(result);
+    return addrs.empty() ? EAI_NONAME : 0;
+}
+
+
+int connect(int sock, const Address& addr)
+{
+    int err = connect(sock, addr.get(), addr.len);
+    if (err == -1) {
+        return errno;
+    }
+    return 0;
+}
+
+
+int getConnectResult(int sock)
+{
+    int err;
+    socklen_t err_len = sizeof(err);
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR,  &err, &err_len) != 0) {
+        perror("getsockopt");
+        throw 28;
+    }
+    return err;
+}
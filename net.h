@@ -0,0 +1,85 @@
+#ifndef NET_H
+#define NET_H
+
+#include <string>
+#include <vector>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// Socket helpers shared by the workers and the upstream pool. Errors
+// are reported with perror() and a -1 result unless noted otherwise.
+
+
+// An IPv4 or IPv6 socket address, len is 0 while it is unset.
+struct Address
+{
+    struct sockaddr_storage storage;
+    socklen_t               len = 0;
+
+    int family() const noexcept { return storage.ss_family; }
+    const struct sockaddr* get() const noexcept {
+        return reinterpret_cast<const struct sockaddr*>(&storage);
+    }
+    struct sockaddr* get() noexcept {
+        return reinterpret_cast<struct sockaddr*>(&storage);
+    }
+
+    bool operator==(const Address& other) const noexcept;
+    bool operator!=(const Address& other) const noexcept {
+        return !(*this == other);
+    }
+    // "1.2.3.4:443" or "[::1]:443".
+    std::string string() const;
+};
+
+
+// How the proxy's TCP sockets are tuned. A 0 leaves the kernel's
+// setting alone.
+struct SocketOptions
+{
+    int  backlog       = 1024;  // capped by net.core.somaxconn
+    // Seconds a client that sent nothing waits in the kernel before it
+    // is accepted (TCP_DEFER_ACCEPT). Only for protocols where the
+    // client speaks first, as TLS and HTTP do.
+    int  deferAccept   = 0;
+    // TFO queue of the listeners; the kernel only takes it with bit 2
+    // of net.ipv4.tcp_fastopen set.
+    int  fastOpen      = 0;
+    // TFO towards the upstream: the SYN waits for the first write and
+    // carries it. A backend that is down then fails the relay, not the
+    // connect, so the connect is not retried elsewhere.
+    bool fastOpenConnect = false;
+    bool noDelay       = true;  // TCP_NODELAY, we write what we read
+    int  receiveBuffer = 0;     // SO_RCVBUF, disables autotuning
+    int  sendBuffer    = 0;     // SO_SNDBUF, disables autotuning
+};
+
+
+int createNonblockingSocket(int family = AF_INET);
+// host is a numeric address or a name resolved on the spot. "::"
+// listens on IPv6 and IPv4 alike. Accepted sockets inherit noDelay and
+// the buffer sizes from the listener; cpu >= 0 sets SO_INCOMING_CPU,
+// so that of a SO_REUSEPORT group the kernel picks the listener of the
+// CPU that took the SYN.
+int createServerSocket(const char* host, int port, bool reusePort,
+                       const SocketOptions& options, int cpu = -1);
+// Tunes an upstream socket before its connect. Reports nothing, on
+// false errno tells the option that failed and the socket is usable
+// all the same.
+bool tuneUpstreamSocket(int sock, const SocketOptions& options);
+
+// Fills addr with a numeric IPv4 or IPv6 host and a port, false if the
+// host is not numeric. Reports nothing.
+bool makeAddress(const char* host, int port, Address& addr);
+// Resolves host, numeric or a name, with getaddrinfo(3), which blocks.
+// The addresses come in the order of RFC 6724. Returns 0 or the EAI_*
+// error.
+int resolveAddresses(const char* host, int port,
+                     std::vector<Address>& addrs);
+// Starts a non-blocking connect, returns 0 or the errno value.
+int connect(int sock, const Address& addr);
+// Returns the result of a finished non-blocking connect as an errno value.
+int getConnectResult(int sock);
+
+#endif // NET_H
@@ -0,0 +1,143 @@
+#include <cerrno>
+#include <cstdio>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "poller.h"
+
+
+void PollPoller::add(int sock, int events)
+{
+    if (sock >= (int) m_index.size()) {
+        m_index.resize(sock + 1, -1);
+    }
+    if (m_index[sock] >= 0) {
+        return modify(sock, events);
+    }
+
+    struct pollfd pfd;
+    pfd.fd = sock;
+    pfd.events = events;
+    pfd.revents = 0;
+    m_index[sock] = m_pfds.size();
+    m_pfds.push_back(pfd);
+}
+
+
+void PollPoller::modify(int sock, int events)
+{
+    if (sock >= (int) m_index.size() || m_index[sock] < 0) {
+        return add(sock, events);
+    }
+    m_pfds[m_index[sock]].events = events;
+}
+
+
+void PollPoller::remove(int sock)
+{
+    if (sock >= (int) m_index.size() || m_index[sock] < 0) {
+        return;
+    }
+    int i = m_index[sock];
+    m_pfds[i] = m_pfds.back();
+    m_index[m_pfds[i].fd] = i;
+    m_pfds.pop_back();
+    m_index[sock] = -1;
+}
+
+
+int PollPoller::wait(std::vector<ReadyEvent>& ready, int timeoutMs)
+{
+    ready.clear();
+
+    int ready_n = poll(m_pfds.data(), m_pfds.size(), timeoutMs);
+    if (ready_n <= 0) {
+        return ready_n;
+    }
+
+    for (auto& pfd : m_pfds)
+    {
+        if (pfd.revents) {
+            ready.push_back({pfd.fd, pfd.revents});
+            pfd.revents = 0;
+        }
+    }
+    return ready.size();
+}
+
+
+EpollPoller::EpollPoller(bool edgeTriggered)
+    : m_edgeTriggered(edgeTriggered)
+{
+    m_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epfd < 0) {
+        perror("epoll_create1");
+        throw 28;
+    }
+}
+
+
+EpollPoller::~EpollPoller() {
+    close(m_epfd);
+}
+
+
+void EpollPoller::control(int op, int sock, int events)
+{
+    struct epoll_event ev;
+    ev.events = events;
+    if (m_edgeTriggered) {
+        ev.events |= EPOLLET;
+    }
+    ev.data.fd = sock;
+
+    if (epoll_ctl(m_epfd, op, sock, &ev) == 0) {
+        return;
+    }
+
+    // The descriptor may have been closed and reused behind our back,
+    // which leaves the kernel's view out of sync with the caller's.
+    if (op == EPOLL_CTL_ADD && errno == EEXIST) {
+        return control(EPOLL_CTL_MOD, sock, events);
+    }
+    if (op == EPOLL_CTL_MOD && errno == ENOENT) {
+        return control(EPOLL_CTL_ADD, sock, events);
+    }
+    perror("epoll_ctl");
+}
+
+
+void EpollPoller::add(int sock, int events) {
+    control(EPOLL_CTL_ADD, sock, events);
+}
+
+
+void EpollPoller::modify(int sock, int events) {
+    control(EPOLL_CTL_MOD, sock, events);
+}
+
+
+void EpollPoller::remove(int sock)
+{
+    // ENOENT and EBADF only mean the kernel already forgot the socket.
+    epoll_ctl(m_epfd, EPOLL_CTL_DEL, sock, nullptr);
+}
+
+
+int EpollPoller::wait(std::vector<ReadyEvent>& ready, int timeoutMs)
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    ready.clear();
+
+    int ready_n = epoll_wait(m_epfd, events, MAX_EVENTS, timeoutMs);
+    if (ready_n <= 0) {
+        return ready_n;
+    }
+
+    for (int i = 0; i < ready_n; ++i) {
+        ready.push_back({events[i].data.fd, (int) events[i].events});
+    }
+    return ready_n;
+}
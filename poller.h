@@ -0,0 +1,67 @@
+#ifndef POLLER_H
+#define POLLER_H
+
+#include <vector>
+
+#include <poll.h>
+
+
+struct ReadyEvent
+{
+    int fd;
+    int events;
+};
+
+
+// Kernel side of the Selector: keeps the interest set between calls
+// to wait() so that only changes have to be passed to the kernel.
+// Events are expressed with the POLL* constants.
+class Poller
+{
+public:
+    virtual ~Poller() {}
+
+    virtual void add(int sock, int events) = 0;
+    virtual void modify(int sock, int events) = 0;
+    virtual void remove(int sock) = 0;
+
+    virtual int wait(std::vector<ReadyEvent>& ready, int timeoutMs) = 0;
+};
+
+
+class PollPoller : public Poller
+{
+    std::vector<struct pollfd> m_pfds;
+    std::vector<int>           m_index;
+
+public:
+    virtual void add(int sock, int events) override;
+    virtual void modify(int sock, int events) override;
+    virtual void remove(int sock) override;
+
+    virtual int wait(std::vector<ReadyEvent>& ready, int timeoutMs) override;
+};
+
+
+class EpollPoller : public Poller
+{
+    static const int MAX_EVENTS = 256;
+
+    int  m_epfd;
+    bool m_edgeTriggered;
+
+public:
+    explicit EpollPoller(bool edgeTriggered);
+    ~EpollPoller();
+
+    virtual void add(int sock, int events) override;
+    virtual void modify(int sock, int events) override;
+    virtual void remove(int sock) override;
+
+    virtual int wait(std::vector<ReadyEvent>& ready, int timeoutMs) override;
+
+private:
+    void control(int op, int sock, int events);
+};
+
+#endif // POLLER_H
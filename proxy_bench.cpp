@@ -0,0 +1,417 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+
+// Drives an echo service (echo-server, ssl-echo-server, or the proxy in
+// front of one) with `concurrency` clients sending `messageSize` byte
+// messages and waiting for the echo. With requestsPerConnection set a
+// client reconnects after that many round trips, which sets the
+// connection churn. The result is printed as one JSON object, along
+// with the kernel's counters of dropped SYNs and TCP Fast Open over the
+// run, which the accept path of the proxy shows in.
+
+using Clock = std::chrono::steady_clock;
+
+
+struct Options
+{
+    std::string host = "127.0.0.1";
+    int         port = 8080;
+    int         concurrency = 10;
+    size_t      messageSize = 64;
+    int         requestsPerConnection = 0;
+    double      duration = 10;
+    bool        tls = false;
+    bool        fastOpen = false;
+
+    struct sockaddr_storage addr = {}; // host and port, resolved once
+    socklen_t               addrLen = 0;
+};
+
+
+struct Stats
+{
+    unsigned long       connections = 0;
+    unsigned long       handshakes  = 0;
+    unsigned long       requests    = 0;
+    unsigned long       errors      = 0;
+    unsigned long long  bytes       = 0;
+    std::vector<double> latencies;        // microseconds per round trip
+    std::vector<double> connectLatencies; // microseconds incl. handshake
+
+    void merge(const Stats& other)
+    {
+        connections += other.connections;
+        handshakes += other.handshakes;
+        requests += other.requests;
+        errors += other.errors;
+        bytes += other.bytes;
+        latencies.insert(latencies.end(),
+            other.latencies.begin(), other.latencies.end());
+        connectLatencies.insert(connectLatencies.end(),
+            other.connectLatencies.begin(), other.connectLatencies.end());
+    }
+};
+
+
+class Client
+{
+    const Options& m_options;
+    SSL_CTX       *m_ctx;
+    int            m_sock;
+    SSL           *m_ssl;
+
+public:
+    Client(const Options& options, SSL_CTX* ctx)
+        : m_options(options), m_ctx(ctx), m_sock(-1), m_ssl(nullptr) {}
+
+    ~Client() {
+        disconnect();
+    }
+
+    bool connected() const noexcept {
+        return m_sock >= 0;
+    }
+
+    bool connect()
+    {
+        m_sock = socket(m_options.addr.ss_family, SOCK_STREAM, 0);
+        if (m_sock < 0) {
+            perror("socket");
+            return false;
+        }
+
+        struct timeval tv = {5, 0};
+        setsockopt(m_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(m_sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        // Every message goes out at once, Nagle would only add a delayed
+        // ACK to the measured latency.
+        int on = 1;
+        setsockopt(m_sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        if (m_options.fastOpen) {
+            setsockopt(m_sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on,
+                       sizeof(on));
+        }
+
+        if (::connect(m_sock, (const struct sockaddr*) &m_options.addr,
+                      m_options.addrLen)) {
+            disconnect();
+            return false;
+        }
+
+        if (m_ctx)
+        {
+            m_ssl = SSL_new(m_ctx);
+            SSL_set_fd(m_ssl, m_sock);
+            if (SSL_connect(m_ssl) != 1) {
+                disconnect();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void disconnect()
+    {
+        if (m_ssl) {
+            SSL_shutdown(m_ssl);
+            SSL_free(m_ssl);
+            m_ssl = nullptr;
+        }
+        if (m_sock >= 0) {
+            close(m_sock);
+            m_sock = -1;
+        }
+    }
+
+    bool writeAll(const char* buf, size_t len)
+    {
+        while (len > 0)
+        {
+            int n = m_ssl ? SSL_write(m_ssl, buf, len)
+                          : send(m_sock, buf, len, MSG_NOSIGNAL);
+            if (n <= 0) {
+                return false;
+            }
+            buf += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    bool readAll(char* buf, size_t len)
+    {
+        while (len > 0)
+        {
+            int n = m_ssl ? SSL_read(m_ssl, buf, len)
+                          : recv(m_sock, buf, len, 0);
+            if (n <= 0) {
+                return false;
+            }
+            buf += n;
+            len -= n;
+        }
+        return true;
+    }
+};
+
+
+static double micros(Clock::duration d) {
+    return std::chrono::duration<double, std::micro>(d).count();
+}
+
+
+void runClient(const Options& options, SSL_CTX* ctx, int id,
+               Clock::time_point deadline, Stats& stats)
+{
+    std::vector<char> message(options.messageSize);
+    std::vector<char> echo(options.messageSize);
+    for (size_t i = 0; i < message.size(); ++i) {
+        message[i] = 'a' + (id + i) % 26;
+    }
+
+    Client client(options, ctx);
+    int requests = 0;
+
+    while (Clock::now() < deadline)
+    {
+        if (!client.connected())
+        {
+            auto start = Clock::now();
+            if (!client.connect()) {
+                ++stats.errors;
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                continue;
+            }
+            stats.connectLatencies.push_back(micros(Clock::now() - start));
+            ++stats.connections;
+            stats.handshakes += ctx != nullptr;
+            requests = 0;
+        }
+
+        auto start = Clock::now();
+        if (!client.writeAll(message.data(), message.size()) ||
+            !client.readAll(echo.data(), echo.size()) ||
+            memcmp(message.data(), echo.data(), message.size()) != 0)
+        {
+            ++stats.errors;
+            client.disconnect();
+            continue;
+        }
+        stats.latencies.push_back(micros(Clock::now() - start));
+        ++stats.requests;
+        stats.bytes += 2 * message.size();
+
+        if (options.requestsPerConnection &&
+            ++requests == options.requestsPerConnection)
+        {
+            client.disconnect();
+        }
+    }
+}
+
+
+// Resolves options.host and options.port into options.addr.
+bool resolve(Options& options)
+{
+    struct addrinfo hints = {};
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+
+    struct addrinfo *res;
+    std::string port = std::to_string(options.port);
+    int err = getaddrinfo(options.host.c_str(), port.c_str(), &hints, &res);
+    if (err != 0) {
+        std::cerr << options.host << ": " << gai_strerror(err) << std::endl;
+        return false;
+    }
+    memcpy(&options.addr, res->ai_addr, res->ai_addrlen);
+    options.addrLen = res->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+
+// The TcpExt counters of /proc/net/netstat, empty where it is missing.
+std::map<std::string, long long> readTcpCounters()
+{
+    std::map<std::string, long long> counters;
+    std::ifstream in("/proc/net/netstat");
+    std::string names, values;
+    while (std::getline(in, names) && std::getline(in, values))
+    {
+        if (names.compare(0, 7, "TcpExt:") != 0) {
+            continue;
+        }
+        std::istringstream n(names), v(values);
+        std::string name, value;
+        n >> name;
+        v >> value;
+        while (n >> name && v >> value) {
+            counters[name] = std::stoll(value);
+        }
+    }
+    return counters;
+}
+
+
+std::string percentiles(std::vector<double>& values)
+{
+    char buf[256];
+    if (values.empty()) {
+        return "{}";
+    }
+    std::sort(values.begin(), values.end());
+    auto at = [&values](double q) {
+        return values[std::min(values.size() - 1,
+                               (size_t) (q * values.size()))];
+    };
+    snprintf(buf, sizeof(buf),
+             "{\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}",
+             at(0.5), at(0.99), at(0.999), values.back());
+    return buf;
+}
+
+
+void printUsage() {
+    std::cerr << "Usage: [-a host] [-p port] [-c concurrency] "
+                 "[-m message-size] [-r requests-per-connection]\n"
+                 "       [-d seconds] [-s] [-f]" << std::endl;
+}
+
+
+int main(int argc, char* argv[])
+{
+    Options options;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:p:c:m:r:d:sfh")) != -1)
+    {
+        switch (opt) {
+        case 'a':
+            options.host = optarg;
+            break;
+        case 'p':
+            options.port = atoi(optarg);
+            break;
+        case 'c':
+            options.concurrency = std::max(1, atoi(optarg));
+            break;
+        case 'm':
+            options.messageSize = std::max(1, atoi(optarg));
+            break;
+        case 'r':
+            options.requestsPerConnection = std::max(0, atoi(optarg));
+            break;
+        case 'd':
+            options.duration = atof(optarg);
+            break;
+        case 's':
+            options.tls = true;
+            break;
+        case 'f':
+            options.fastOpen = true;
+            break;
+        case 'h':
+            printUsage();
+            return 0;
+        default:
+            printUsage();
+            return 1;
+        }
+    }
+
+    if (options.port <= 0 || options.port > 65535) {
+        std::cerr << "invalid port " << options.port << std::endl;
+        return 1;
+    }
+    if (!resolve(options)) {
+        return 1;
+    }
+
+    SSL_CTX *ctx = nullptr;
+    if (options.tls)
+    {
+        OpenSSL_add_ssl_algorithms();
+        SSL_load_error_strings();
+        ctx = SSL_CTX_new(TLS_client_method());
+        if (!ctx) {
+            std::cerr << "cannot create ssl context" << std::endl;
+            return 1;
+        }
+        // Every connection pays for a full handshake.
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    }
+
+    std::vector<Stats> stats(options.concurrency);
+    std::vector<std::thread> threads;
+
+    auto before = readTcpCounters();
+    auto start = Clock::now();
+    auto deadline = start + std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(options.duration));
+
+    for (int i = 0; i < options.concurrency; ++i) {
+        threads.emplace_back(runClient, std::cref(options), ctx, i,
+                             deadline, std::ref(stats[i]));
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    auto after = readTcpCounters();
+    auto delta = [&before, &after](const char* name) {
+        return after[name] - before[name];
+    };
+
+    Stats total;
+    for (auto& s : stats) {
+        total.merge(s);
+    }
+
+    printf("{\"concurrency\": %d, \"message_size\": %zu, "
+           "\"requests_per_connection\": %d, \"tls\": %s, "
+           "\"duration\": %.3f, \"connections\": %lu, \"requests\": %lu, "
+           "\"errors\": %lu, \"connections_per_sec\": %.1f, "
+           "\"handshakes_per_sec\": %.1f, \"requests_per_sec\": %.1f, "
+           "\"mb_per_sec\": %.3f, \"latency_us\": %s, "
+           "\"connect_latency_us\": %s, \"listen_overflows\": %lld, "
+           "\"listen_drops\": %lld, \"fastopen_active\": %lld, "
+           "\"fastopen_passive\": %lld}\n",
+           options.concurrency, options.messageSize,
+           options.requestsPerConnection, options.tls ? "true" : "false",
+           elapsed, total.connections, total.requests, total.errors,
+           total.connections / elapsed, total.handshakes / elapsed,
+           total.requests / elapsed, total.bytes / elapsed / 1e6,
+           percentiles(total.latencies).c_str(),
+           percentiles(total.connectLatencies).c_str(),
+           delta("ListenOverflows"), delta("ListenDrops"),
+           delta("TCPFastOpenActive"), delta("TCPFastOpenPassive"));
+
+    if (ctx) {
+        SSL_CTX_free(ctx);
+    }
+    // A run that never got through measured nothing.
+    return total.connections > 0 ? 0 : 1;
+}
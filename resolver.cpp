@@ -0,0 +1,85 @@
+#include "resolver.h"
+
+
+Resolver::Resolver(long ttlSeconds)
+    : m_ttl(std::chrono::seconds(ttlSeconds)), m_stop(false),
+      m_thread([this] { run(); }) {}
+
+
+Resolver::~Resolver()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wakeup.notify_one();
+    m_thread.join();
+
+    for (Request *req : m_queue) {
+        delete req;
+    }
+}
+
+
+void Resolver::resolve(const std::string& host, int port, Selector* sel,
+                       Handler h)
+{
+    Request *req = new Request();
+    req->host = host;
+    req->port = port;
+    req->selector = sel;
+    req->handler = std::move(h);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push_back(req);
+    }
+    m_wakeup.notify_one();
+}
+
+
+void Resolver::run()
+{
+    while (true)
+    {
+        Request *req;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wakeup.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+            if (m_stop) {
+                return;
+            }
+            req = m_queue.front();
+            m_queue.pop_front();
+        }
+
+        lookup(*req);
+
+        // The request goes with the handler, which frees it on the loop.
+        req->selector->post([req]
+        {
+            req->handler(req->err, req->addrs);
+            delete req;
+        });
+    }
+}
+
+
+void Resolver::lookup(Request& req)
+{
+    std::string key = req.host + " " + std::to_string(req.port);
+    auto now = Clock::now();
+
+    auto iter = m_cache.find(key);
+    if (iter != m_cache.end() && now < iter->second.expires) {
+        req.addrs = iter->second.addrs;
+        return;
+    }
+
+    req.err = resolveAddresses(req.host.c_str(), req.port, req.addrs);
+    if (req.err != 0) {
+        return;
+    }
+    Entry& entry = m_cache[key];
+    entry.addrs = req.addrs;
+    entry.expires = now + m_ttl;
+}
@@ -0,0 +1,79 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "inplace_function.h"
+#include "net.h"
+#include "selector.h"
+
+
+// Resolves host names for all the workers on a thread of its own, so
+// that getaddrinfo(3) never blocks an event loop. The result of a
+// lookup is posted to the selector that asked for it and the handler
+// runs there.
+//
+// Results are cached for ttl. getaddrinfo(3) does not tell the TTL of
+// the records, so the configured one stands in for it; it also bounds
+// how long a backend that moved is connected to at its old address.
+// Failed lookups are not cached.
+class Resolver
+{
+public:
+    using Handler =
+        InplaceFunction<void (int err, const std::vector<Address>& addrs)>;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Request
+    {
+        std::string          host;
+        int                  port;
+        Selector            *selector;
+        Handler              handler;
+        int                  err = 0;
+        std::vector<Address> addrs;
+    };
+
+    struct Entry
+    {
+        std::vector<Address> addrs;
+        Clock::time_point    expires;
+    };
+
+    Clock::duration         m_ttl;
+    std::mutex              m_mutex;
+    std::condition_variable m_wakeup;
+    std::deque<Request*>    m_queue;
+    bool                    m_stop;
+    // Only the resolver thread touches the cache.
+    std::unordered_map<std::string, Entry> m_cache; // by "host port"
+    std::thread             m_thread;
+
+public:
+    explicit Resolver(long ttlSeconds);
+    ~Resolver();
+
+    Resolver(const Resolver&) = delete;
+    Resolver& operator=(const Resolver&) = delete;
+
+    // Looks host up and calls h on sel's loop with 0 and the addresses,
+    // or with an EAI_* error. Lookups still queued when the resolver is
+    // destroyed are dropped.
+    void resolve(const std::string& host, int port, Selector* sel,
+                 Handler h);
+
+private:
+    void run();
+    void lookup(Request& req);
+};
+
+#endif // RESOLVER_H
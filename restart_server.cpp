@@ -0,0 +1,245 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "restart_server.h"
+
+
+// The most descriptors Linux passes in one message (SCM_MAX_FD).
+static const size_t MAX_FDS = 253;
+
+
+static bool makeUnixAddress(const std::string& path, sockaddr_un& addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "restart: path too long: %s\n", path.c_str());
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    return true;
+}
+
+
+RestartServer::RestartServer(ListenersHandler listeners,
+                             HandedOverHandler handedOver)
+    : m_listeners(std::move(listeners)), m_handedOver(std::move(handedOver)),
+      m_selector(Selector::Backend::Poll), m_listener(-1), m_peer(-1) {}
+
+
+bool RestartServer::listenAndServe(const std::string& path)
+{
+    sockaddr_un addr;
+    if (!makeUnixAddress(path, addr)) {
+        return false;
+    }
+    m_listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        0);
+    if (m_listener < 0) {
+        perror("socket");
+        return false;
+    }
+    // The process that served the path before has handed it over, or is
+    // gone and left the file behind.
+    unlink(path.c_str());
+    if (bind(m_listener, (sockaddr*) &addr, sizeof(addr)) != 0 ||
+        listen(m_listener, BACKLOG) != 0)
+    {
+        perror("bind");
+        ::close(m_listener);
+        return false;
+    }
+
+    do_accept();
+    m_selector.run();
+
+    closePeer();
+    m_selector.removeEvents(m_listener);
+    ::close(m_listener);
+    return true;
+}
+
+
+void RestartServer::shutdown() {
+    m_selector.stop();
+}
+
+
+void RestartServer::do_accept()
+{
+    m_selector.addReadEvent(m_listener, [this](int)
+    {
+        int sock = accept4(m_listener, nullptr, nullptr,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return do_accept();
+        }
+        if (m_peer >= 0) {
+            ::close(sock);
+            return do_accept();
+        }
+        m_peer = sock;
+        handOver();
+        do_accept();
+    });
+}
+
+
+void RestartServer::handOver()
+{
+    std::vector<int> fds;
+    if (!m_listeners(fds) || fds.empty() || fds.size() > MAX_FDS)
+    {
+        std::clog << "restart: no listeners to hand over" << std::endl;
+        for (int fd : fds) {
+            ::close(fd);
+        }
+        return closePeer();
+    }
+
+    uint32_t count = fds.size();
+    struct iovec iov = {&count, sizeof(count)};
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+
+    // A fresh socket has room for the message, it does not block.
+    int n = sendmsg(m_peer, &msg, MSG_NOSIGNAL);
+    for (int fd : fds) {
+        ::close(fd);
+    }
+    if (n != (int) sizeof(count)) {
+        perror("sendmsg");
+        return closePeer();
+    }
+
+    std::clog << "restart: handed " << count << " listeners over"
+              << std::endl;
+    m_selector.startTimer(m_timeout, TIMEOUT_MS, [this]
+    {
+        std::clog << "restart: the new process is not ready" << std::endl;
+        closePeer();
+    });
+    do_read();
+}
+
+
+void RestartServer::do_read()
+{
+    m_selector.addReadEvent(m_peer, [this](int sock)
+    {
+        char ready;
+        int n = recv(sock, &ready, 1, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return do_read();
+        }
+        closePeer();
+        if (n != 1) {
+            std::clog << "restart: the new process went away" << std::endl;
+            return;
+        }
+        m_handedOver();
+    });
+}
+
+
+void RestartServer::closePeer()
+{
+    if (m_peer < 0) {
+        return;
+    }
+    m_selector.stopTimer(m_timeout);
+    m_selector.removeEvents(m_peer);
+    ::close(m_peer);
+    m_peer = -1;
+}
+
+
+int RestartServer::takeOver(const std::string& path, std::vector<int>& fds)
+{
+    sockaddr_un addr;
+    if (!makeUnixAddress(path, addr)) {
+        throw 28;
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("socket");
+        throw 28;
+    }
+    if (connect(sock, (sockaddr*) &addr, sizeof(addr)) != 0)
+    {
+        int err = errno;
+        ::close(sock);
+        if (err == ENOENT || err == ECONNREFUSED) {
+            return -1;
+        }
+        errno = err;
+        perror("connect");
+        throw 28;
+    }
+
+    struct timeval timeout = {TIMEOUT_MS / 1000, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    uint32_t count = 0;
+    struct iovec iov = {&count, sizeof(count)};
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * MAX_FDS));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    int n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = n == (int) sizeof(count) ? CMSG_FIRSTHDR(&msg)
+                                                     : nullptr;
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        size_t received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        fds.resize(received);
+        memcpy(fds.data(), CMSG_DATA(cmsg), sizeof(int) * received);
+    }
+    if (fds.empty() || fds.size() != count) {
+        fprintf(stderr, "restart: the running process handed no listeners "
+                        "over\n");
+        for (int fd : fds) {
+            ::close(fd);
+        }
+        fds.clear();
+        ::close(sock);
+        throw 28;
+    }
+    return sock;
+}
+
+
+void RestartServer::ready(int sock)
+{
+    char ready = 1;
+    if (send(sock, &ready, 1, MSG_NOSIGNAL) != 1) {
+        perror("send");
+    }
+    ::close(sock);
+}
@@ -0,0 +1,66 @@
+#ifndef RESTART_SERVER_H
+#define RESTART_SERVER_H
+
+#include <string>
+#include <vector>
+
+#include "inplace_function.h"
+#include "selector.h"
+
+
+// Hands the listening sockets over to a new process, so that upgrading
+// the proxy refuses no client. The new process is started with the same
+// path: takeOver() connects to it and receives the sockets with
+// SCM_RIGHTS, and once it accepts on them ready() answers with a byte,
+// upon which this process drains. Until then both accept on the same
+// sockets. The new process then serves the path for the next restart.
+//
+// Connections are not handed over, they finish in the old process; TLS
+// state and relay buffers do not travel with a descriptor.
+//
+// Like the metrics server it runs its own event loop on its own thread.
+class RestartServer
+{
+public:
+    // Fills in duplicates of the listening sockets, which the server
+    // closes once they are sent, or returns false when there are none
+    // to hand over any longer.
+    using ListenersHandler = InplaceFunction<bool (std::vector<int>& fds)>;
+    using HandedOverHandler = InplaceFunction<void ()>;
+
+private:
+    static const int BACKLOG = 4;
+    static const int TIMEOUT_MS = 10000; // for the new process to be ready
+
+    ListenersHandler  m_listeners;
+    HandedOverHandler m_handedOver;
+
+    Selector m_selector;
+    int      m_listener;
+    int      m_peer;   // the new process, one at a time
+    Timer    m_timeout;
+
+public:
+    RestartServer(ListenersHandler listeners, HandedOverHandler handedOver);
+    ~RestartServer() = default;
+
+    // Returns false if it cannot listen on path.
+    bool listenAndServe(const std::string& path);
+    void shutdown();
+
+    // Takes the listening sockets over from the process serving path.
+    // Returns the socket to call ready() on, or -1 with no sockets when
+    // no process serves path. Throws 28 when the handover fails.
+    static int takeOver(const std::string& path, std::vector<int>& fds);
+    // Tells the old process that the sockets are served here now and
+    // closes sock.
+    static void ready(int sock);
+
+private:
+    void do_accept();
+    void do_read();
+    void handOver();
+    void closePeer();
+};
+
+#endif // RESTART_SERVER_H
@@ -1,66 +1,466 @@
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
 #include "selector.h"
 
+
+Selector::Selector(Backend backend, Metrics* metrics)
+    : m_backend(backend), m_uring(nullptr), m_inflight(0),
+      m_start(Clock::now()), m_now(0), m_wakeup(-1), m_iteration(0),
+      m_handled(0), m_metrics(metrics), m_stop(false)
+{
+    m_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_wakeup < 0) {
+        perror("eventfd");
+        throw 28;
+    }
+
+    if (backend == Backend::IoUring)
+    {
+        try {
+            m_uring = new UringPoller();
+            m_poller.reset(m_uring);
+        }
+        catch (int) {
+            fprintf(stderr, "io_uring is not available, using epoll\n");
+            m_backend = Backend::Epoll;
+        }
+    }
+
+    if (m_backend == Backend::Poll) {
+        m_poller.reset(new PollPoller());
+    } else if (m_backend != Backend::IoUring) {
+        m_poller.reset(new EpollPoller(m_backend == Backend::EpollEdge));
+    }
+    addReadEvent(m_wakeup, [this](int) { do_wakeup(); });
+}
+
+
+Selector::~Selector() {
+    close(m_wakeup);
+}
+
+
+Selector::Registration* Selector::find(int sock) noexcept
+{
+    if (sock < 0 || sock >= (int) m_registrations.size()) {
+        return nullptr;
+    }
+    Registration *reg = &m_registrations[sock];
+    return reg->added ? reg : nullptr;
+}
+
+
 void Selector::addEvent(int sock, int event, EventHandler h)
 {
-    auto [iter, inserted] = m_handlers.emplace(sock, h);
-    if (!inserted) {
+    if (sock >= (int) m_registrations.size()) {
+        m_registrations.resize(sock + 1);
+    }
+    Registration& reg = m_registrations[sock];
+
+    EventHandler& slot = event == POLLIN ? reg.onRead : reg.onWrite;
+    if (slot) {
         throw 28;
     }
-    struct pollfd pfd;
-    pfd.fd = sock;
-    pfd.events = event;
-    pfd.revents = 0;
-    m_pfds.push_back(pfd);  
+    slot = std::move(h);
+
+    bool added = reg.added;
+    if (!added) {
+        reg.added = true;
+        reg.since = m_iteration;
+    }
+
+    if (m_backend == Backend::EpollEdge)
+    {
+        // Both directions are watched for the whole lifetime of the
+        // descriptor, edges are remembered in reg.ready.
+        if (!added) {
+            reg.interest = POLLIN | POLLOUT;
+            m_poller->add(sock, reg.interest);
+        }
+        else if (reg.ready & (event | POLLERR | POLLHUP)) {
+            m_pending.push_back(sock);
+        }
+        return;
+    }
+
+    int events = reg.interest | event;
+    if (!added) {
+        m_poller->add(sock, events);
+    }
+    else if (reg.interest != events) {
+        m_poller->modify(sock, events);
+    }
+    reg.interest = events;
 }
 
 
-void Selector::addReadEvent(int sock, EventHandler h) {    
-    addEvent(sock, POLLIN, h);
+void Selector::addReadEvent(int sock, EventHandler h) {
+    addEvent(sock, POLLIN, std::move(h));
 }
 
 
 void Selector::addWriteEvent(int sock, EventHandler h) {
-    addEvent(sock, POLLOUT, h);
+    addEvent(sock, POLLOUT, std::move(h));
+}
+
+
+void Selector::cancelEvents(int sock)
+{
+    Registration *reg = find(sock);
+    if (reg) {
+        reg->onRead = nullptr;
+        reg->onWrite = nullptr;
+    }
+}
+
+
+void Selector::removeEvents(int sock)
+{
+    Registration *reg = find(sock);
+    if (reg) {
+        *reg = Registration();
+        m_poller->remove(sock);
+    }
+}
+
+
+void Selector::wouldBlock(int sock, int events)
+{
+    Registration *reg = find(sock);
+    if (reg) {
+        reg->ready &= ~events;
+    }
+}
+
+
+uint64_t Selector::ticks() const noexcept
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        Clock::now() - m_start).count();
+}
+
+
+void Selector::startTimer(Timer& timer, long delayMs, TimerHandler h)
+{
+    // The tick has begun already, so the timer is due one tick later.
+    m_timers.start(timer, ticks() + delayMs + 1, std::move(h));
+}
+
+
+void Selector::addTimer(int delayMs, TimerHandler h)
+{
+    OneShot *shot;
+    if (m_freeOneShots.empty()) {
+        m_oneShots.emplace_back();
+        shot = &m_oneShots.back();
+    } else {
+        shot = m_freeOneShots.back();
+        m_freeOneShots.pop_back();
+    }
+    shot->handler = std::move(h);
+    startTimer(shot->timer, delayMs, [this, shot]
+    {
+        TimerHandler handler = std::move(shot->handler);
+        shot->handler = nullptr;
+        m_freeOneShots.push_back(shot);
+        handler();
+    });
+}
+
+
+uint32_t Selector::newOperation(CompletionHandler h)
+{
+    uint32_t id;
+    if (m_freeOperations.empty()) {
+        id = m_operations.size();
+        m_operations.emplace_back();
+    } else {
+        id = m_freeOperations.back();
+        m_freeOperations.pop_back();
+    }
+    m_operations[id].handler = std::move(h);
+    ++m_inflight;
+    return id;
+}
+
+
+void Selector::submitAccept(int sock, CompletionHandler h) {
+    m_uring->accept(sock, newOperation(std::move(h)));
+}
+
+
+void Selector::submitConnect(int sock, const Address& addr,
+                             CompletionHandler h)
+{
+    // The kernel reads the address when the request is submitted, the
+    // operation keeps it until then.
+    uint32_t id = newOperation(std::move(h));
+    Address& copy = m_operations[id].addr;
+    copy = addr;
+    m_uring->connect(sock, copy.get(), copy.len, id);
+}
+
+
+void Selector::submitRecv(int sock, void* buf, size_t len,
+                          CompletionHandler h)
+{
+    m_uring->recv(sock, buf, len, newOperation(std::move(h)));
+}
+
+
+void Selector::submitSend(int sock, const void* buf, size_t len,
+                          CompletionHandler h)
+{
+    m_uring->send(sock, buf, len, newOperation(std::move(h)));
+}
+
+
+void Selector::cancelOperations(int sock) {
+    m_uring->cancel(sock);
 }
 
 
 int Selector::run()
 {
-    m_stop.store(false);
-    while (!m_stop.load()) 
+    while (!m_stop.load())
     {
-        int ready_n = poll(&m_pfds[0], m_pfds.size(), TIMEOUT_MS);
+        int ready_n = m_poller->wait(m_ready, nextTimeout());
 
         if (ready_n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
             perror("poll");
             return errno;
         }
-        
-        if (ready_n == 0) {
-            continue;
-        }
+
+        ++m_iteration;
+        m_handled = 0;
+        m_now = ticks();
+        executeCompletions();
         executeHandlers();
+        executePending();
+        executeTimers();
+
+        if (m_metrics) {
+            m_metrics->iterations.add();
+            m_metrics->handlersPerWakeup.observe(m_handled);
+        }
     }
     return 0;
 }
 
 
-void Selector::executeHandlers()
+int Selector::nextTimeout()
 {
-    auto pfds = std::move(m_pfds);
-    auto handlers = std::move(m_handlers);
+    if (!m_pending.empty()) {
+        return 0;
+    }
+    uint64_t next = m_timers.next();
+    if (next == UINT64_MAX) {
+        return -1;
+    }
+    uint64_t now = ticks();
+    if (next <= now) {
+        return 0;
+    }
+    return next - now < INT_MAX ? next - now : INT_MAX;
+}
+
 
-    for (auto& pfd : pfds) 
+void Selector::executeTimers()
+{
+    // Handlers see the time their timers expired at.
+    m_now = ticks();
+    while (Timer *timer = m_timers.expire(m_now))
     {
-        if (pfd.revents & (POLLIN | POLLOUT | POLLERR | POLLHUP)) {
-            handlers[pfd.fd](pfd.fd);
+        TimerHandler handler = m_timers.take(*timer);
+        handler();
+    }
+}
+
+
+void Selector::executeHandlers()
+{
+    for (auto& ev : m_ready)
+    {
+        Registration *reg = find(ev.fd);
+
+        // The descriptor was closed and reused by an earlier handler
+        // of this batch, the event belongs to the old one.
+        if (!reg || reg->since == m_iteration) {
+            continue;
+        }
+
+        if (m_backend == Backend::EpollEdge) {
+            reg->ready |= ev.events;
+            execute(ev.fd, reg->ready);
+            continue;
+        }
+
+        // Stop level-triggered wakeups nobody is waiting for. Errors
+        // are reported whatever the interest, so an idle descriptor
+        // that fails leaves the poller until a handler is added again.
+        int events = reg->events();
+        if (!events && (ev.events & (POLLERR | POLLHUP))) {
+            *reg = Registration();
+            m_poller->remove(ev.fd);
             continue;
         }
-        addEvent(pfd.fd, pfd.events, handlers[pfd.fd]);
+        if (ev.events & ~events & (POLLIN | POLLOUT)) {
+            reg->interest = events;
+            m_poller->modify(ev.fd, events);
+        }
+        execute(ev.fd, ev.events);
+    }
+}
+
+
+void Selector::executeCompletions()
+{
+    if (!m_uring) {
+        return;
+    }
+
+    for (auto& c : m_uring->completions())
+    {
+        Operation& op = m_operations[c.id];
+        CompletionHandler handler = std::move(op.handler);
+        op.handler = nullptr;
+        m_freeOperations.push_back(c.id);
+        --m_inflight;
+
+        ++m_handled;
+        handler(c.res);
     }
 }
 
 
-void Selector::stop() {
+void Selector::drain()
+{
+    if (!m_uring || m_inflight == 0) {
+        return;
+    }
+
+    m_uring->cancelAll();
+    for (int tries = 0; m_inflight > 0 && tries < 100; ++tries)
+    {
+        if (m_poller->wait(m_ready, TIMEOUT_MS) < 0 && errno != EINTR) {
+            perror("io_uring_enter");
+            return;
+        }
+        executeCompletions();
+    }
+}
+
+
+void Selector::executePending()
+{
+    if (m_pending.empty()) {
+        return;
+    }
+
+    auto pending = std::move(m_pending);
+    m_pending.clear();
+
+    for (int sock : pending)
+    {
+        Registration *reg = find(sock);
+        if (reg) {
+            execute(sock, reg->ready);
+        }
+    }
+}
+
+
+void Selector::execute(int sock, int revents)
+{
+    // A handler may grow the table or remove sock, so the registration
+    // is looked up again after the first one.
+    Registration *reg = find(sock);
+    if (!reg) {
+        return;
+    }
+    unsigned since = reg->since;
+
+    if (reg->onRead && (revents & (POLLIN | POLLERR | POLLHUP))) {
+        EventHandler handler = std::move(reg->onRead);
+        reg->onRead = nullptr;
+        ++m_handled;
+        handler(sock);
+    }
+
+    reg = find(sock);
+    if (reg && reg->since == since && reg->onWrite && (revents & (POLLOUT | POLLERR | POLLHUP))) {
+        EventHandler handler = std::move(reg->onWrite);
+        reg->onWrite = nullptr;
+        ++m_handled;
+        handler(sock);
+    }
+}
+
+
+void Selector::stop()
+{
     m_stop.store(true);
-}
\ No newline at end of file
+    wakeup();
+}
+
+
+void Selector::post(PostedHandler h)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_postMutex);
+        m_posted.push_back(std::move(h));
+    }
+    wakeup();
+}
+
+
+void Selector::wakeup() noexcept
+{
+    uint64_t one = 1;
+    if (write(m_wakeup, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("write");
+    }
+}
+
+
+void Selector::runPosted(int timeoutMs)
+{
+    struct pollfd pfd = {m_wakeup, POLLIN, 0};
+    if (poll(&pfd, 1, timeoutMs) < 0 && errno != EINTR) {
+        perror("poll");
+        return;
+    }
+    executePosted();
+}
+
+
+void Selector::do_wakeup()
+{
+    executePosted();
+    wouldBlock(m_wakeup, POLLIN);
+    addReadEvent(m_wakeup, [this](int) { do_wakeup(); });
+}
+
+
+void Selector::executePosted()
+{
+    uint64_t count;
+    while (read(m_wakeup, &count, sizeof(count)) > 0) {}
+
+    {
+        std::lock_guard<std::mutex> lock(m_postMutex);
+        m_running.swap(m_posted);
+    }
+    for (auto& handler : m_running) {
+        handler();
+    }
+    m_running.clear();
+}
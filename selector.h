@@ -1,34 +1,174 @@
 #ifndef SELECTOR_H
 #define SELECTOR_H
 
-#include <functional>
-#include <map>
+#include <chrono>
+#include <deque>
+#include <memory>
 #include <vector>
 #include <atomic>
+#include <mutex>
 
-#include <poll.h>
+#include "inplace_function.h"
+#include "metrics.h"
+#include "net.h"
+#include "poller.h"
+#include "timer_wheel.h"
+#include "uring_poller.h"
 
 
-using EventHandler = std::function<void (int sock)>;
+using EventHandler = InplaceFunction<void (int sock)>;
+using CompletionHandler = InplaceFunction<void (int res)>;
+using PostedHandler = InplaceFunction<void ()>;
 
+// Every handler is one-shot: it is dropped before it is called and has
+// to be added again to wait for the next event. The descriptor itself
+// stays registered with the kernel until removeEvents(), so re-arming
+// the same event costs no system call.
+//
+// Handlers live in a table indexed by descriptor with one slot for
+// reading and one for writing, so a socket can wait for both at once.
+// Adding a handler to a taken slot throws. cancelEvents() empties both
+// slots but keeps the registration.
+//
+// In the edge-triggered backend a handler may be called speculatively,
+// so the I/O it does can fail with EAGAIN; it must then report it with
+// wouldBlock() before waiting for the event again.
+//
+// Timers are one-shot as well and fire on the loop thread no earlier
+// than their delay. They live in a timer wheel: addTimer() is fire and
+// forget, while a Timer owned by the caller can be started again or
+// stopped at O(1) cost, which suits timeouts that are mostly pushed
+// back or cancelled. The loop sleeps until the next timer is due, or
+// until stop() or post() wakes it up through an eventfd. Those two are
+// the only methods other threads may call.
+//
+// The io_uring backend also runs operations instead of waiting for
+// readiness: submitAccept() and friends start the system call and the
+// handler gets its result, a negative errno on failure. Readiness
+// handlers keep working next to them. Without io_uring, which is
+// tried at startup, the selector falls back to epoll and
+// completions() is false.
 class Selector
 {
-    static const int TIMEOUT_MS = 50;
+public:
+    enum class Backend { Poll, Epoll, EpollEdge, IoUring };
+
+private:
+    static const int TIMEOUT_MS = 50; // of drain()
+
+    struct Registration
+    {
+        bool         added    = false; // known to the poller
+        int          interest = 0;     // events the kernel watches
+        int          ready    = 0;     // edge-triggered readiness left
+        unsigned     since    = 0;     // iteration it was added in
+        EventHandler onRead;
+        EventHandler onWrite;
+
+        int events() const noexcept {
+            return (onRead ? POLLIN : 0) | (onWrite ? POLLOUT : 0);
+        }
+    };
+
+    struct Operation
+    {
+        CompletionHandler handler;
+        Address           addr;
+    };
+
+    struct OneShot
+    {
+        Timer        timer;
+        TimerHandler handler;
+    };
 
-    std::map<int, EventHandler> m_handlers;
-    std::vector<struct pollfd>  m_pfds;
+    using Clock = std::chrono::steady_clock;
+
+    Backend                     m_backend;
+    std::unique_ptr<Poller>     m_poller;
+    UringPoller                *m_uring;      // m_poller with io_uring
+    std::deque<Operation>       m_operations; // indexed by id
+    std::vector<uint32_t>       m_freeOperations;
+    size_t                      m_inflight;
+    std::vector<Registration>   m_registrations; // indexed by descriptor
+    std::vector<ReadyEvent>     m_ready;
+    std::vector<int>            m_pending;
+    TimerWheel                  m_timers;     // ticks are milliseconds
+    std::deque<OneShot>         m_oneShots;   // of addTimer()
+    std::vector<OneShot*>       m_freeOneShots;
+    Clock::time_point           m_start;      // of tick 0
+    uint64_t                    m_now;        // tick of the last wakeup
+    int                         m_wakeup;     // eventfd for stop()
+    std::mutex                  m_postMutex;  // and post()
+    std::vector<PostedHandler>  m_posted;
+    std::vector<PostedHandler>  m_running;    // m_posted being run
+    unsigned                    m_iteration;
+    unsigned                    m_handled; // handlers run this iteration
+    Metrics                    *m_metrics;
     std::atomic<bool>           m_stop;
 
 public:
+    // Loop iterations and handlers per wakeup are counted in metrics
+    // when it is set.
+    explicit Selector(Backend backend = Backend::Epoll,
+                      Metrics* metrics = nullptr);
+    ~Selector();
+
+    Selector(const Selector&) = delete;
+    Selector& operator=(const Selector&) = delete;
+
     void addReadEvent(int sock, EventHandler h);
     void addWriteEvent(int sock, EventHandler h);
+    void cancelEvents(int sock);
+    void removeEvents(int sock);
+    void wouldBlock(int sock, int events);
+    void addTimer(int delayMs, TimerHandler h);
+    // Starts timer, or moves it if it is running already.
+    void startTimer(Timer& timer, long delayMs, TimerHandler h);
+    void stopTimer(Timer& timer) noexcept { m_timers.cancel(timer); }
+    // Milliseconds since the selector was created, as of the last
+    // wakeup; cheap enough to stamp every read and write with.
+    uint64_t now() const noexcept { return m_now; }
+
+    bool completions() const noexcept { return m_uring != nullptr; }
+    void submitAccept(int sock, CompletionHandler h);
+    void submitConnect(int sock, const Address& addr, CompletionHandler h);
+    // buf has to stay valid until the handler is called.
+    void submitRecv(int sock, void* buf, size_t len, CompletionHandler h);
+    void submitSend(int sock, const void* buf, size_t len,
+                    CompletionHandler h);
+    // Completes the operations on sock with -ECANCELED. sock has to
+    // stay open until they are back.
+    void cancelOperations(int sock);
 
     int run();
     void stop();
+    // Runs h on the loop thread at its next wakeup. Handlers posted
+    // after run() has returned are dropped with the selector.
+    void post(PostedHandler h);
+    // Waits up to timeoutMs for posted handlers after run() has
+    // returned and runs them.
+    void runPosted(int timeoutMs);
+    // Cancels the operations still running after run() and calls their
+    // handlers, so that their buffers can be freed.
+    void drain();
 
 private:
-    void addEvent(int sock, int events, EventHandler h);
+    void addEvent(int sock, int event, EventHandler h);
+    Registration* find(int sock) noexcept;
+
+    uint32_t newOperation(CompletionHandler h);
+
     void executeHandlers();
+    void executeCompletions();
+    void executePending();
+    void execute(int sock, int revents);
+    void executeTimers();
+    int nextTimeout();
+    uint64_t ticks() const noexcept;
+    void wakeup() noexcept;
+    void do_wakeup();
+    void executePosted();
 };
 
 #endif // SELECTOR_H
@@ -1,206 +1,361 @@
-#include <sys/socket.h>
-#include <sys/types.h>
-#include <arpa/inet.h>
-#include <fcntl.h>
+#include <cerrno>
+#include <cstdio>
+#include <exception>
+#include <iostream>
+#include <thread>
+
+#include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 
 #include "server.h"
-#include "connection.h"
 #include "ssl_connection.h"
 
 
-int createNonblockingSocket()
+Server::Server(const Config& config)
+    : m_config(config), m_restartChannel(-1), m_accepting(false)
 {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == -1) {
-        perror("socket");
-        return -1;
+    // The workers copy the backends with their first addresses, which
+    // are looked up here before anything runs. Host names are looked up
+    // again later on by the resolver thread.
+    bool names = false;
+    for (auto& backend : m_config.backends)
+    {
+        int err = resolveAddresses(backend.host.c_str(), backend.port,
+                                   backend.addrs);
+        if (err != 0) {
+            throw ServerException(("cannot resolve " + backend.host + ": " +
+                                   gai_strerror(err)).c_str());
+        }
+        Address addr;
+        if (!makeAddress(backend.host.c_str(), backend.port, addr)) {
+            names = true;
+        }
     }
-
-    if (fcntl(sock, F_SETFL, O_NONBLOCK) != 0) {
-        perror("fcntl");
-        close(sock);
-        return -1;
+    if (names && m_config.dnsTtl > 0) {
+        m_resolver.reset(new Resolver(m_config.dnsTtl));
     }
-
-    return sock;
-}
-
-
-int createServerSocket(const char* host, int port, int backlog)
-{
-    int sock = createNonblockingSocket();
-    if (sock < 0) {
-        return -1;
+    if (m_config.handshakeThreads > 0) {
+        m_handshakes.reset(new HandshakePool(m_config.handshakeThreads));
     }
 
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    if (!inet_aton(host, &addr.sin_addr)) {
-        perror("inet_aton");
-        return -1;
+    // A worker per listener taken over, which keeps every SO_REUSEPORT
+    // socket of the group served.
+    if (!m_config.restartPath.empty())
+    {
+        try {
+            m_restartChannel =
+                RestartServer::takeOver(m_config.restartPath, m_inherited);
+        }
+        catch (int) {
+            throw ServerException("cannot take the listeners over");
+        }
+        if (!m_inherited.empty()) {
+            std::clog << "restart: took " << m_inherited.size()
+                      << " listeners over" << std::endl;
+            m_config.workers = m_inherited.size();
+        }
+        m_restartServer.reset(new RestartServer(
+            [this](std::vector<int>& fds) { return handOver(fds); },
+            [this] { drain(); }));
     }
 
-    if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
-        perror("bind");
-        close(sock);
-        return -1;
+    if (m_config.admission.any()) {
+        m_admission.reset(new Admission(m_config.admission));
+    }
+    int workers = m_config.workers > 0 ? m_config.workers : 1;
+    for (int i = 0; i < workers; ++i) {
+        m_workers.emplace_back(new Worker(m_config, i, m_resolver.get(),
+                                          m_handshakes.get(),
+                                          m_admission.get()));
     }
 
-    if (listen(sock, backlog) < 0) {
-        perror("listen");
-        close(sock);
-        return -1;
-    } 
+    // The workers take the CPUs the process may run on in turn.
+    cpu_set_t set;
+    if (m_config.incomingCpu && workers > 1 &&
+        sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        std::vector<int> allowed;
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) {
+                allowed.push_back(cpu);
+            }
+        }
+        for (int i = 0; i < workers; ++i) {
+            m_cpus.push_back(allowed[i % allowed.size()]);
+        }
+    }
 
-    return sock;
+    if (config.metricsPort > 0)
+    {
+        std::vector<const Metrics*> metrics;
+        std::vector<const TraceRing*> traces;
+        for (auto& worker : m_workers) {
+            metrics.push_back(&worker->metrics());
+            traces.push_back(&worker->traces());
+        }
+        m_metricsServer.reset(new MetricsServer(
+            std::move(metrics), std::move(traces), backendNames()));
+    }
 }
 
 
-int connect(int sock, const char* host, int port)
+Server::~Server()
 {
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    if (!inet_aton(host, &addr.sin_addr)) {
-        perror("inet_aton");
-        return -1;
+    for (int fd : m_inherited) {
+        close(fd);
     }
-
-    int err = connect(sock, (struct sockaddr*) &addr, sizeof(addr));
-    if (err == -1) {
-        return errno;
+    if (m_restartChannel >= 0) {
+        close(m_restartChannel);
     }
-    return 0;
 }
 
 
-int getConnectResult(int sock)
+void Server::listenAndServe()
 {
-    int err;
-    socklen_t err_len;
-    if (getsockopt(sock, SOL_SOCKET, SO_ERROR,  &err, &err_len) != 0) {
-        perror("getsockopt");
-        throw 28;
-    }
-    return err;
+    serve(false);
 }
 
-Server::Server(int portToListen, const std::string& host, int port)
-    : m_portToListen(portToListen), 
-      m_host(host), m_port(port), m_enableSSL(false) {}
 
+void Server::listenAndServeTLS(const char* CAfile)
+{
+    try {
+        SSLConnection::init(CAfile, m_config.sessionCacheSize,
+                            m_config.sessionLifetime, m_config.ktls);
+        serve(true);
+        SSLConnection::free();
+    } 
+    catch (SSLException& e) {
+        throw ServerException(e.what());
+    }
+}
 
-void Server::listenAndServe()
+
+void Server::shutdown()
 {
-    if (m_host == "localhost") {
-        m_host = "127.0.0.1";
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_accepting = false;
     }
-    in_addr addr;
-    if (!inet_aton(m_host.c_str(), &addr)) {
-        throw ServerException("invalid address");
+    for (auto& worker : m_workers) {
+        worker->shutdown();
     }
-
-    m_listener = createServerSocket("127.0.0.1", m_portToListen, BACKLOG);
-    if (m_listener < 0) {
-        return;
+    if (m_metricsServer) {
+        m_metricsServer->shutdown();
+    }
+    if (m_restartServer) {
+        m_restartServer->shutdown();
     }
-    do_accept();
-    m_selector.run();
-    closeConnections();
 }
 
 
-void Server::shutdown() {
-    m_selector.stop();
+void Server::drain()
+{
+    // The workers close their listeners, which must not be handed over
+    // from then on.
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_accepting = false;
+    }
+    for (auto& worker : m_workers) {
+        worker->drain();
+    }
 }
 
 
-void Server::do_accept()
+void Server::dumpTraces(std::ostream& out)
 {
-    m_selector.addReadEvent(m_listener, 
-        [this](int) 
-        {
-            int client = accept4(m_listener, nullptr, nullptr, SOCK_NONBLOCK);
-            if (client < 0) {
-                perror("accept");
-                return;
-            }     
-            do_connect(client);
-            this->do_accept();
-        });
+    std::vector<const TraceRing*> traces;
+    for (auto& worker : m_workers) {
+        traces.push_back(&worker->traces());
+    }
+    std::string lines;
+    writeTraces(lines, traces, backendNames());
+    out << lines << std::flush;
 }
 
 
-void Server::do_connect(int client)
+std::vector<std::string> Server::backendNames() const
 {
-
-    int server = createNonblockingSocket();
-    if (server < 0) {
-        ::shutdown(client, SHUT_RDWR);
-        close(client);
-        return;
+    std::vector<std::string> names;
+    const Balancer& balancer = m_workers.front()->balancer();
+    for (size_t i = 0; i < balancer.size(); ++i) {
+        names.push_back(balancer[i].peer);
     }
+    return names;
+}
 
-    int err = connect(server, m_host.c_str(), m_port);
 
-    if (err < 0 && err != EINPROGRESS) {
-        ::shutdown(client, SHUT_RDWR);
-        close(client);
-        close(server);
+void Server::pin(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        errno = err;
+        perror("pthread_setaffinity_np");
     }
-
-    m_selector.addWriteEvent(server,
-        [this, client](int server) 
-        {
-            if (getConnectResult(server) != 0) 
-            {
-                ::shutdown(client, SHUT_RDWR);
-                ::shutdown(server, SHUT_RDWR);
-                close(client);
-                close(server);
-                return;
-            }
-            IConnection *conn = createConnection(client, server);
-            m_connections.insert(conn);
-        });
 }
 
 
-IConnection* Server::createConnection(int client, int server)
+bool Server::handOver(std::vector<int>& fds)
 {
-    if (m_enableSSL) {
-        return new SSLConnection(this, &m_selector, client, server);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_accepting) {
+        return false;
+    }
+    for (int fd : m_listeners) {
+        int copy = dup(fd);
+        if (copy < 0) {
+            perror("dup");
+            return false;
+        }
+        fds.push_back(copy);
     }
-    return new Connection(this, &m_selector, client, server);
+    return true;
 }
 
 
-void Server::listenAndServeTLS(const char* CAfile)
+bool Server::listen(std::vector<int>& listeners)
 {
-    try {
-        SSLConnection::init(CAfile); 
-        m_enableSSL = true;
-        listenAndServe();
-        SSLConnection::free();
-    } 
-    catch (SSLException& e) {
-        throw ServerException(e.what());
+    // Taken over listeners keep the options they were created with.
+    if (!m_inherited.empty()) {
+        listeners.swap(m_inherited);
+        return true;
+    }
+    for (size_t i = 0; i < m_workers.size(); ++i)
+    {
+        int sock = createServerSocket(m_config.listenAddress.c_str(),
+                                      m_config.portToListen,
+                                      m_workers.size() > 1,
+                                      m_config.socketOptions,
+                                      m_cpus.empty() ? -1 : m_cpus[i]);
+        if (sock < 0) {
+            for (int fd : listeners) {
+                close(fd);
+            }
+            listeners.clear();
+            return false;
+        }
+        listeners.push_back(sock);
     }
-    closeConnections();
+    return true;
 }
 
 
-void Server::removeConnection(IConnection* conn) 
+void Server::serve(bool enableSSL)
 {
-    m_connections.erase(conn);
-    delete conn;
-}
+    std::vector<int> listeners;
+    if (!listen(listeners)) {
+        throw ServerException("cannot listen");
+    }
 
-void Server::closeConnections() 
-{
-    for (IConnection* conn : m_connections) {
-        conn->close();
+    bool terminateTLS = !m_config.certFile.empty();
+    if (terminateTLS)
+    {
+        try {
+            SSLConnection::initServer(m_config.certFile.c_str(),
+                                      m_config.keyFile.c_str(),
+                                      m_config.sessionCacheSize,
+                                      m_config.sessionLifetime);
+        }
+        catch (SSLException& e) {
+            SSLConnection::freeServer();
+            for (int fd : listeners) {
+                close(fd);
+            }
+            throw ServerException(e.what());
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_listeners = listeners;
+        m_accepting = true;
+    }
+
+    // The first worker runs on the calling thread. A worker that fails
+    // takes the others down with it and its error is rethrown here.
+    std::vector<std::exception_ptr> errors(m_workers.size());
+    auto run = [this, enableSSL, &errors, &listeners](size_t i)
+    {
+        if (!m_cpus.empty()) {
+            pin(m_cpus[i]);
+        }
+        try {
+            m_workers[i]->listenAndServe(enableSSL, listeners[i]);
+        }
+        catch (...) {
+            errors[i] = std::current_exception();
+            shutdown();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < m_workers.size(); ++i) {
+        threads.emplace_back(run, i);
     }
-}
\ No newline at end of file
+
+    // The metrics and restart servers outlive the workers, which may
+    // drain for a while.
+    std::vector<std::thread> services;
+    std::exception_ptr metricsError;
+    if (m_metricsServer) {
+        services.emplace_back([this, &metricsError]
+        {
+            if (!m_metricsServer->listenAndServe(m_config.metricsPort)) {
+                metricsError = std::make_exception_ptr(
+                    ServerException("cannot listen for metrics"));
+                shutdown();
+            }
+        });
+    }
+    std::exception_ptr restartError;
+    if (m_restartServer) {
+        services.emplace_back([this, &restartError]
+        {
+            if (!m_restartServer->listenAndServe(m_config.restartPath)) {
+                restartError = std::make_exception_ptr(
+                    ServerException("cannot listen for restarts"));
+                shutdown();
+            }
+        });
+    }
+    if (m_restartChannel >= 0) {
+        RestartServer::ready(m_restartChannel);
+        m_restartChannel = -1;
+    }
+
+    run(0);
+    for (auto& th : threads) {
+        th.join();
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_accepting = false;
+        m_listeners.clear();
+    }
+    if (m_metricsServer) {
+        m_metricsServer->shutdown();
+    }
+    if (m_restartServer) {
+        m_restartServer->shutdown();
+    }
+    for (auto& th : services) {
+        th.join();
+    }
+
+    if (terminateTLS) {
+        SSLConnection::freeServer();
+    }
+
+    errors.push_back(metricsError);
+    errors.push_back(restartError);
+    for (auto& err : errors) {
+        if (err) {
+            std::rethrow_exception(err);
+        }
+    }
+}
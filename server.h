@@ -1,47 +1,72 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include <ostream>
 #include <string>
-#include <set>
+#include <memory>
+#include <mutex>
+#include <vector>
 
-#include "selector.h"
+#include "config.h"
+#include "handshake_pool.h"
+#include "metrics_server.h"
+#include "resolver.h"
+#include "restart_server.h"
+#include "worker.h"
 
-class IConnection
-{
-public:
-    virtual ~IConnection() {}
-    virtual void close() = 0;
-};
 
 class Server
 {
-    static const int BACKLOG = 16;
+    Config m_config;
 
-    int         m_portToListen;
-    std::string m_host;
-    int         m_port;
-    bool        m_enableSSL;
-    
-    Selector m_selector;
-    int      m_listener;
+    // Outlives the workers, which count their clients in it.
+    std::unique_ptr<Admission>           m_admission;
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::unique_ptr<MetricsServer>       m_metricsServer;
+    std::unique_ptr<RestartServer>       m_restartServer;
+    // Destroyed before the workers, which it posts lookups to.
+    std::unique_ptr<Resolver>            m_resolver;
+    // Destroyed before the workers as well, the workers wait for the
+    // handshakes they handed over when they stop.
+    std::unique_ptr<HandshakePool>       m_handshakes;
 
-    std::set<IConnection*> m_connections;
+    // Listening sockets taken over from the process that ran before,
+    // and the socket to tell it that they are served.
+    std::vector<int> m_inherited;
+    int              m_restartChannel;
+
+    // The CPU of every worker with incomingCpu, empty otherwise.
+    std::vector<int> m_cpus;
+
+    // The workers' listening sockets while they accept on them.
+    std::mutex       m_mutex;
+    std::vector<int> m_listeners;
+    bool             m_accepting;
 
 public:
-    Server(int portToListen, const std::string& host, int port);
-    ~Server() = default;
+    // Resolves the backends and takes the listeners over from a running
+    // process, throws ServerException if either fails.
+    explicit Server(const Config& config);
+    ~Server();
 
     void listenAndServe();
     void listenAndServeTLS(const char* CAfile);
     void shutdown();
+    // Stops accepting and returns from listenAndServe() once the
+    // connections have finished, or cut them after drainTimeout. Any
+    // thread may call it.
+    void drain();
+    // Writes the latency traces of the last closed connections as JSON
+    // lines. Any thread may call it.
+    void dumpTraces(std::ostream& out);
 
-    void removeConnection(IConnection* conn);
 private:
-    void do_accept();
-    void do_connect(int client);
-
-    IConnection* createConnection(int client, int server);
-    void closeConnections();
+    std::vector<std::string> backendNames() const;
+    void serve(bool enableSSL);
+    bool listen(std::vector<int>& listeners);
+    bool handOver(std::vector<int>& fds);
+    // Binds the calling thread to cpu.
+    static void pin(int cpu);
 };
 
 
@@ -57,4 +82,4 @@ public:
 };
 
 
-#endif // SERVER_H
\ No newline at end of file
+#endif // SERVER_H
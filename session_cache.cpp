@@ -0,0 +1,86 @@
+#include <ctime>
+
+#include "session_cache.h"
+
+
+SessionCache::SessionCache(size_t capacity, long lifetime)
+    : m_capacity(capacity), m_lifetime(lifetime),
+      m_hits(0), m_misses(0), m_resumed(0) {}
+
+
+SessionCache::~SessionCache()
+{
+    for (auto& entry : m_entries) {
+        SSL_SESSION_free(entry.session);
+    }
+}
+
+
+SSL_SESSION* SessionCache::get(const std::string& key)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto iter = m_index.find(key);
+    if (iter == m_index.end()) {
+        ++m_misses;
+        return nullptr;
+    }
+
+    SSL_SESSION *session = iter->second->session;
+    if (expired(session)) {
+        erase(iter->second);
+        ++m_misses;
+        return nullptr;
+    }
+
+    m_entries.splice(m_entries.begin(), m_entries, iter->second);
+    SSL_SESSION_up_ref(session);
+    ++m_hits;
+    return session;
+}
+
+
+void SessionCache::put(const std::string& key, SSL_SESSION* session)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // Replacing the session in place keeps the nodes, as a new session
+    // for a known upstream comes with nearly every handshake.
+    auto iter = m_index.find(key);
+    if (iter != m_index.end())
+    {
+        SSL_SESSION_free(iter->second->session);
+        iter->second->session = session;
+        m_entries.splice(m_entries.begin(), m_entries, iter->second);
+        return;
+    }
+
+    if (m_capacity == 0) {
+        SSL_SESSION_free(session);
+        return;
+    }
+    while (m_entries.size() >= m_capacity) {
+        erase(std::prev(m_entries.end()));
+    }
+
+    m_entries.push_front({key, session});
+    m_index[key] = m_entries.begin();
+}
+
+
+bool SessionCache::expired(SSL_SESSION* session) const
+{
+    if (!SSL_SESSION_is_resumable(session)) {
+        return true;
+    }
+    long age = time(nullptr) - SSL_SESSION_get_time(session);
+    return age >= m_lifetime || age >= SSL_SESSION_get_timeout(session);
+}
+
+
+void SessionCache::erase(std::list<Entry>::iterator iter)
+{
+    m_index.erase(iter->key);
+    SSL_SESSION_free(iter->session);
+    m_entries.erase(iter);
+}
@@ -0,0 +1,59 @@
+#ifndef SESSION_CACHE_H
+#define SESSION_CACHE_H
+
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <openssl/ssl.h>
+
+
+// Client-side TLS sessions keyed by upstream "host:port", so that a new
+// connection to a known backend can do an abbreviated handshake. The
+// least recently used session is dropped when the cache is full, and a
+// session is never offered after `lifetime` seconds.
+//
+// The cache is shared by all workers; it is only touched once per
+// handshake, so a mutex is cheap enough.
+class SessionCache
+{
+    struct Entry
+    {
+        std::string  key;
+        SSL_SESSION *session;
+    };
+
+    size_t m_capacity;
+    long   m_lifetime;
+
+    std::mutex m_mutex;
+    std::list<Entry> m_entries; // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> m_index;
+
+    std::atomic<unsigned long> m_hits;
+    std::atomic<unsigned long> m_misses;
+    std::atomic<unsigned long> m_resumed;
+
+public:
+    SessionCache(size_t capacity, long lifetime);
+    ~SessionCache();
+
+    // Returns a new reference the caller has to free, or nullptr.
+    SSL_SESSION* get(const std::string& key);
+    // Takes over the reference to session.
+    void put(const std::string& key, SSL_SESSION* session);
+
+    void countResumed() noexcept { ++m_resumed; }
+
+    unsigned long hits() const noexcept { return m_hits.load(); }
+    unsigned long misses() const noexcept { return m_misses.load(); }
+    unsigned long resumed() const noexcept { return m_resumed.load(); }
+
+private:
+    bool expired(SSL_SESSION* session) const;
+    void erase(std::list<Entry>::iterator iter);
+};
+
+#endif // SESSION_CACHE_H
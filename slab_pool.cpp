@@ -0,0 +1,60 @@
+#include "slab_pool.h"
+
+
+static size_t roundUp(size_t size)
+{
+    const size_t align = alignof(std::max_align_t);
+    return (size + align - 1) / align * align;
+}
+
+
+SlabPool::SlabPool(size_t objectSize)
+    : m_size(roundUp(objectSize)), m_free(nullptr) {}
+
+
+SlabPool::~SlabPool()
+{
+    for (void* slab : m_slabs) {
+        ::operator delete(slab);
+    }
+}
+
+
+void* SlabPool::allocate(size_t size)
+{
+    if (m_size == 0) {
+        m_size = roundUp(size);
+    }
+    if (size > m_size) {
+        return ::operator new(size);
+    }
+
+    if (!m_free) {
+        grow();
+    }
+    FreeObject *obj = m_free;
+    m_free = obj->next;
+    return obj;
+}
+
+
+void SlabPool::deallocate(void* p, size_t size) noexcept
+{
+    if (size > m_size) {
+        return ::operator delete(p);
+    }
+    FreeObject *obj = static_cast<FreeObject*>(p);
+    obj->next = m_free;
+    m_free = obj;
+}
+
+
+void SlabPool::grow()
+{
+    char *slab = static_cast<char*>(::operator new(m_size * OBJECTS_PER_SLAB));
+    m_slabs.push_back(slab);
+
+    for (size_t i = OBJECTS_PER_SLAB; i > 0; --i) {
+        deallocate(slab + (i - 1) * m_size, m_size);
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef SLAB_POOL_H
+#define SLAB_POOL_H
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+
+// Fixed-size object memory carved out of slabs. Freed objects go on a
+// free list and are handed out again, so once a workload has peaked
+// the pool does not touch the heap anymore. The object size is fixed
+// by the constructor or by the first allocation; larger requests go to
+// the heap. Not thread safe, every worker owns its pools.
+class SlabPool
+{
+    static const size_t OBJECTS_PER_SLAB = 64;
+
+    struct FreeObject
+    {
+        FreeObject *next;
+    };
+
+    size_t              m_size;
+    FreeObject         *m_free;
+    std::vector<void*>  m_slabs;
+
+public:
+    explicit SlabPool(size_t objectSize = 0);
+    ~SlabPool();
+
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    void* allocate(size_t size);
+    void deallocate(void* p, size_t size) noexcept;
+
+private:
+    void grow();
+};
+
+
+// Standard allocator on top of a SlabPool, for node-based containers.
+template <typename T>
+class SlabAllocator
+{
+    template <typename U> friend class SlabAllocator;
+
+    SlabPool *m_pool;
+
+public:
+    using value_type = T;
+
+    explicit SlabAllocator(SlabPool* pool) noexcept : m_pool(pool) {}
+
+    template <typename U>
+    SlabAllocator(const SlabAllocator<U>& other) noexcept
+        : m_pool(other.m_pool) {}
+
+    T* allocate(size_t n)
+    {
+        if (n != 1) {
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+        return static_cast<T*>(m_pool->allocate(sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n) noexcept
+    {
+        if (n != 1) {
+            return ::operator delete(p);
+        }
+        m_pool->deallocate(p, sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const SlabAllocator<U>& other) const noexcept {
+        return m_pool == other.m_pool;
+    }
+
+    template <typename U>
+    bool operator!=(const SlabAllocator<U>& other) const noexcept {
+        return m_pool != other.m_pool;
+    }
+};
+
+#endif // SLAB_POOL_H
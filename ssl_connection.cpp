@@ -0,0 +1,630 @@
+#include <cerrno>
+#include <iostream>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "ssl_connection.h"
+
+
+SSL_CTX      *SSLConnection::ctx = nullptr;
+SSL_CTX      *SSLConnection::serverCtx = nullptr;
+SessionCache *SSLConnection::sessions = nullptr;
+
+static const unsigned char SESSION_ID_CONTEXT[] = "ssl-proxy";
+
+
+void SSLConnection::init(
+    const char* CAfile, size_t cacheSize, long cacheLifetime, bool ktls)
+{
+    OpenSSL_add_ssl_algorithms();
+    SSL_load_error_strings();
+
+    ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx) {
+        throw SSLException("SSL_CTX_new");
+    }
+
+    if (!SSL_CTX_load_verify_locations(ctx, CAfile, nullptr)) {
+        throw SSLException("Cannot load certificates");
+    }
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+
+    if (ktls) {
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    }
+
+    if (cacheSize > 0) {
+        // OpenSSL never looks client sessions up by itself, it only
+        // hands new ones to onNewSession().
+        sessions = new SessionCache(cacheSize, cacheLifetime);
+        SSL_CTX_set_session_cache_mode(ctx,
+            SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ctx, onNewSession);
+    }
+}
+
+
+void SSLConnection::free()
+{
+    if (sessions) {
+        std::clog << "session cache: " << sessions->hits() << " hits, "
+                  << sessions->misses() << " misses, "
+                  << sessions->resumed() << " resumed" << std::endl;
+        delete sessions;
+        sessions = nullptr;
+    }
+    SSL_CTX_free(ctx);
+    ctx = nullptr;
+}
+
+
+void SSLConnection::initServer(const char* certFile, const char* keyFile,
+                               size_t cacheSize, long cacheLifetime)
+{
+    OpenSSL_add_ssl_algorithms();
+    SSL_load_error_strings();
+
+    serverCtx = SSL_CTX_new(TLS_server_method());
+    if (!serverCtx) {
+        throw SSLException("SSL_CTX_new");
+    }
+
+    if (SSL_CTX_use_certificate_chain_file(serverCtx, certFile) != 1) {
+        throw SSLException("Cannot load the certificate");
+    }
+    if (SSL_CTX_use_PrivateKey_file(serverCtx, keyFile,
+                                    SSL_FILETYPE_PEM) != 1) {
+        throw SSLException("Cannot load the key");
+    }
+    if (SSL_CTX_check_private_key(serverCtx) != 1) {
+        throw SSLException("The key does not match the certificate");
+    }
+    // Clients that just close the socket are not an error.
+    SSL_CTX_set_options(serverCtx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+
+    if (cacheSize > 0) {
+        // Tickets resume clients without any state on our side, the
+        // cache serves TLS 1.2 clients resuming by session ID.
+        SSL_CTX_set_session_id_context(serverCtx, SESSION_ID_CONTEXT,
+                                       sizeof(SESSION_ID_CONTEXT) - 1);
+        SSL_CTX_set_session_cache_mode(serverCtx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(serverCtx, cacheSize);
+        SSL_CTX_set_timeout(serverCtx, cacheLifetime);
+    } else {
+        SSL_CTX_set_session_cache_mode(serverCtx, SSL_SESS_CACHE_OFF);
+        SSL_CTX_set_options(serverCtx, SSL_OP_NO_TICKET);
+        SSL_CTX_set_num_tickets(serverCtx, 0);
+    }
+}
+
+
+void SSLConnection::freeServer()
+{
+    if (serverCtx) {
+        std::clog << "server session cache: "
+                  << SSL_CTX_sess_hits(serverCtx) << " hits, "
+                  << SSL_CTX_sess_misses(serverCtx) << " misses" << std::endl;
+    }
+    SSL_CTX_free(serverCtx);
+    serverCtx = nullptr;
+}
+
+
+int SSLConnection::onNewSession(SSL* ssl, SSL_SESSION* session)
+{
+    auto peer = static_cast<const std::string*>(SSL_get_app_data(ssl));
+    if (!sessions || !peer) {
+        return 0;
+    }
+    sessions->put(*peer, session);
+    return 1;
+}
+
+
+SSL* SSLConnection::newSSL(int sock, const std::string* peer)
+{
+    SSL *ssl = SSL_new(ctx);
+    if (!ssl) {
+        throw SSLException("SSL_new");
+    }
+
+    if (!SSL_set_fd(ssl, sock)) {
+        SSL_free(ssl);
+        throw SSLException("SSL_set_fd");
+    }
+    setPeer(ssl, peer);
+
+    if (sessions) {
+        SSL_SESSION *session = sessions->get(*peer);
+        if (session) {
+            SSL_set_session(ssl, session);
+            SSL_SESSION_free(session);
+        }
+    }
+    return ssl;
+}
+
+
+void SSLConnection::setPeer(SSL* ssl, const std::string* peer) {
+    SSL_set_app_data(ssl, const_cast<std::string*>(peer));
+}
+
+
+void SSLConnection::handshakeDone(SSL* ssl)
+{
+    if (sessions && SSL_session_reused(ssl)) {
+        sessions->countResumed();
+    }
+}
+
+
+SSLConnection::SSLConnection(Worker* worker, Selector* sel,
+    int clientSock, int serverSock, const std::string& peer,
+    bool clientTLS, bool serverTLS, SSL* serverSSL)
+    : m_worker(worker), m_selector(sel), m_peer(peer),
+      m_client(clientSock), m_server(serverSock),
+      m_upstream(UPSTREAM, &m_client, &m_server, &worker->buffers()),
+      m_downstream(DOWNSTREAM, &m_server, &m_client, &worker->buffers())
+{
+    if (clientTLS)
+    {
+        m_client.ssl = SSL_new(serverCtx);
+        if (!m_client.ssl) {
+            throw SSLException("SSL_new");
+        }
+        SSL_set_fd(m_client.ssl, clientSock);
+        SSL_set_accept_state(m_client.ssl);
+        m_client.handshakeStart = Clock::now();
+        m_handshaking = true;
+    }
+
+    if (serverSSL) {
+        m_server.ssl = serverSSL;
+        m_server.handshaken = true;
+        checkKtls(m_server);
+        setPeer(serverSSL, &m_peer);
+    }
+    else if (serverTLS)
+    {
+        try {
+            m_server.ssl = newSSL(serverSock, &m_peer);
+        }
+        catch (...) {
+            SSL_free(m_client.ssl);
+            throw;
+        }
+        SSL_set_connect_state(m_server.ssl);
+        m_server.handshakeStart = Clock::now();
+        m_handshaking = true;
+
+        // Send the ClientHello now, the upstream does not talk first.
+        // With a handshake pool the downstream waits for the step, which
+        // builds the key share off the loop. Otherwise a failure shows up
+        // again in the first SSL_read().
+        if (!offload(m_downstream, m_server)) {
+            SSL_do_handshake(m_server.ssl);
+            ERR_clear_error();
+        }
+    }
+
+    do_wait(m_upstream);
+    do_wait(m_downstream);
+}
+
+
+SSLConnection::~SSLConnection()
+{
+    SSL_free(m_client.ssl);
+    SSL_free(m_server.ssl);
+}
+
+
+void SSLConnection::close()
+{
+    if (m_closing) {
+        return;
+    }
+    m_closing = true;
+    m_trace.bytesUp = m_upstream.total;
+    m_trace.bytesDown = m_downstream.total;
+
+    // Without a close_notify OpenSSL marks the session as not resumable.
+    for (Side *side : {&m_client, &m_server})
+    {
+        if (side->ssl && !side->offloaded &&
+            SSL_is_init_finished(side->ssl) &&
+            !(SSL_get_shutdown(side->ssl) & SSL_SENT_SHUTDOWN))
+        {
+            SSL_shutdown(side->ssl);
+        }
+    }
+    ERR_clear_error();
+
+    m_selector->removeEvents(m_client.sock);
+    m_selector->removeEvents(m_server.sock);
+    shutdown(m_client.sock, SHUT_RDWR);
+    shutdown(m_server.sock, SHUT_RDWR);
+
+    // A handshake step still uses its socket, which must not be reused
+    // before it is back.
+    if (!m_client.offloaded && !m_server.offloaded) {
+        finish();
+    }
+}
+
+
+void SSLConnection::finish()
+{
+    ::close(m_client.sock);
+    ::close(m_server.sock);
+    m_worker->removeConnection(this);
+}
+
+
+void SSLConnection::do_wait(Pipe& p)
+{
+    Side *side = p.blockedOn;
+    int event = p.blockedFor;
+    p.blockedOn = nullptr;
+
+    if (!side) {
+        side = p.wantsWrite() ? p.to : p.from;
+        event = p.wantsWrite() ? POLLOUT : POLLIN;
+    }
+    else if (event == HANDSHAKE) {
+        // do_handshaken() runs the pipe when the step is back.
+        side->waitHandshake |= p.id;
+        return;
+    }
+
+    int& waiting = event == POLLIN ? side->waitRead : side->waitWrite;
+    bool armed = waiting != 0;
+    waiting |= p.id;
+    if (armed) {
+        return;
+    }
+
+    auto handler = [this, side, event](int) { do_ready(*side, event); };
+    if (event == POLLIN) {
+        m_selector->addReadEvent(side->sock, handler);
+    } else {
+        m_selector->addWriteEvent(side->sock, handler);
+    }
+}
+
+
+void SSLConnection::do_ready(Side& side, int event)
+{
+    int& waiting = event == HANDSHAKE ? side.waitHandshake :
+                   event == POLLIN ? side.waitRead : side.waitWrite;
+    int pipes = waiting;
+    waiting = 0;
+
+    if ((pipes & UPSTREAM) && !do_relay(m_upstream)) {
+        return;
+    }
+    if (pipes & DOWNSTREAM) {
+        do_relay(m_downstream);
+    }
+}
+
+
+bool SSLConnection::do_relay(Pipe& p)
+{
+    // OpenSSL reads one record at a time, so what the other pipe's
+    // operations leave unread stays in the socket and wakes this one.
+    // Only the rest of a record this pipe read in part is kept in the
+    // SSL, which is why reading goes on while it has some, whatever
+    // the budget.
+    size_t budget = m_worker->config().relayBudget;
+    size_t start = p.total;
+    while (true)
+    {
+        if (p.wantsRead() && !do_read(p)) {
+            this->close();
+            return false;
+        }
+        if (p.wantsWrite() && !do_write(p)) {
+            this->close();
+            return false;
+        }
+        if (p.done()) {
+            break;
+        }
+        if (p.blockedOn || p.wantsWrite()) {
+            do_wait(p);
+            return true;
+        }
+        bool pending = p.from->ssl && SSL_pending(p.from->ssl) > 0;
+        if (!pending && p.total - start >= budget) {
+            do_wait(p);
+            return true;
+        }
+    }
+
+    // A client gone before the upstream handshake finished, as a TCP
+    // check or a port scan is, has nothing to relay. Half-closing would
+    // fail the handshake and blame a backend that did nothing wrong.
+    if (&p == &m_upstream && m_server.ssl && !m_server.handshaken) {
+        this->close();
+        return false;
+    }
+
+    // The SSL of a side on a handshake thread is not touched, it is
+    // shut down when the step is back.
+    Side *to = p.to;
+    if (to->offloaded) {
+        to->shutPending = true;
+    } else {
+        shutdownWrite(*to);
+    }
+    p.shut = true;
+    if (m_upstream.shut && m_downstream.shut) {
+        this->close();
+        return false;
+    }
+    return true;
+}
+
+
+void SSLConnection::shutdownWrite(Side& side)
+{
+    if (side.ssl && SSL_is_init_finished(side.ssl)) {
+        SSL_shutdown(side.ssl);
+        ERR_clear_error();
+    }
+    shutdown(side.sock, SHUT_WR);
+}
+
+
+bool SSLConnection::do_read(Pipe& p)
+{
+    Side& side = *p.from;
+    struct iovec iov[2];
+    int n;
+
+    p.buf.space(iov);
+    if (side.ssl && offload(p, side)) {
+        return true;
+    }
+    if (side.ssl) {
+        n = SSL_read(side.ssl, iov[0].iov_base, iov[0].iov_len);
+        checkHandshake(side);
+        if (n <= 0) {
+            int err = SSL_get_error(side.ssl, n);
+            if (err == SSL_ERROR_ZERO_RETURN) {
+                p.eof = true;
+                return true;
+            }
+            return do_ssl_error(p, side, err);
+        }
+    }
+    else {
+        n = recv(side.sock, iov[0].iov_base, iov[0].iov_len, 0);
+        if (n == 0) {
+            p.eof = true;
+            return true;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                block(p, side, POLLIN);
+                return true;
+            }
+            return false;
+        }
+    }
+
+    m_active = m_selector->now();
+    p.buf.produced(n);
+    return true;
+}
+
+
+bool SSLConnection::do_write(Pipe& p)
+{
+    Side& side = *p.to;
+    struct iovec iov[2];
+    int n;
+
+    // A write that has to be retried is retried with the same buffer
+    // and length, as OpenSSL requires.
+    p.buf.data(iov);
+    if (side.ssl && offload(p, side)) {
+        return true;
+    }
+    if (side.ssl) {
+        n = SSL_write(side.ssl, iov[0].iov_base, iov[0].iov_len);
+        checkHandshake(side);
+        if (n <= 0) {
+            return do_ssl_error(p, side, SSL_get_error(side.ssl, n));
+        }
+    }
+    else {
+        n = send(side.sock, iov[0].iov_base, iov[0].iov_len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                block(p, side, POLLOUT);
+                return true;
+            }
+            return false;
+        }
+    }
+
+    m_active = m_selector->now();
+    if (p.total == 0) {
+        (&p == &m_upstream ? m_trace.firstUp : m_trace.firstDown) = traceNow();
+    }
+    p.total += n;
+    Metrics& metrics = m_worker->metrics();
+    (&p == &m_upstream ? metrics.bytesUp : metrics.bytesDown).add(n);
+
+    p.buf.consumed(n);
+    return true;
+}
+
+
+bool SSLConnection::do_ssl_error(Pipe& p, Side& side, int err,
+                                 unsigned long error)
+{
+    if (err == SSL_ERROR_WANT_READ) {
+        block(p, side, POLLIN);
+        return true;
+    }
+    if (err == SSL_ERROR_WANT_WRITE) {
+        block(p, side, POLLOUT);
+        return true;
+    }
+
+    // The backend failed the handshake, or went away during it; not
+    // after we shut a pipe down, which may have failed it ourselves.
+    if (&side == &m_server && !side.handshaken &&
+        !m_upstream.shut && !m_downstream.shut)
+    {
+        m_worker->reportUpstream(this, false);
+    }
+
+    if (err == SSL_ERROR_SSL) {
+        char errstr[256];
+        ERR_error_string_n(error ? error : ERR_get_error(), errstr,
+                           sizeof(errstr));
+        std::clog << "connection " << m_client.sock << ": "
+                  << (&side == &m_client ? "client" : "server") << " "
+                  << errstr << std::endl;
+    }
+    ERR_clear_error();
+    return false;
+}
+
+
+void SSLConnection::block(Pipe& p, Side& side, int event)
+{
+    p.blockedOn = &side;
+    p.blockedFor = event;
+    m_selector->wouldBlock(side.sock, event);
+    // Nothing to relay until the event, the pool can have the memory.
+    p.buf.idle();
+}
+
+
+bool SSLConnection::offload(Pipe& p, Side& side)
+{
+    HandshakePool *pool = m_worker->handshakes();
+    if (!pool || side.handshaken) {
+        return false;
+    }
+
+    p.blockedOn = &side;
+    p.blockedFor = HANDSHAKE;
+    p.buf.idle();
+    if (side.offloaded) {
+        return true;
+    }
+
+    // Edges from before the step are stale, the ones that come in
+    // while it runs are kept for when it is back.
+    m_selector->wouldBlock(side.sock, POLLIN | POLLOUT);
+    side.offloaded = true;
+    m_worker->metrics().handshakesOffloaded.add();
+    Side *s = &side;
+    pool->handshake(side.ssl, m_selector,
+        [this, s](int err, unsigned long error, double wait) {
+            do_handshaken(*s, err, error, wait);
+        });
+    return true;
+}
+
+
+void SSLConnection::do_handshaken(Side& side, int err, unsigned long error,
+                                  double wait)
+{
+    side.offloaded = false;
+    Metrics& metrics = m_worker->metrics();
+    metrics.handshakesReturned.add();
+    metrics.handshakeQueueWait.observe(wait);
+
+    if (m_closing) {
+        if (!m_client.offloaded && !m_server.offloaded) {
+            finish();
+        }
+        return;
+    }
+    if (side.shutPending) {
+        side.shutPending = false;
+        shutdownWrite(side);
+    }
+
+    if (err == SSL_ERROR_NONE) {
+        checkHandshake(side);
+        do_ready(side, HANDSHAKE);
+        return;
+    }
+
+    int pipes = side.waitHandshake;
+    side.waitHandshake = 0;
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+    {
+        // Not block(), which would drop an edge that came in while the
+        // step ran. The next step is handed over when the event fires.
+        int event = err == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT;
+        for (Pipe *p : {&m_upstream, &m_downstream})
+        {
+            if (pipes & p->id) {
+                p->blockedOn = &side;
+                p->blockedFor = event;
+                do_wait(*p);
+            }
+        }
+        return;
+    }
+
+    do_ssl_error(pipes & UPSTREAM ? m_upstream : m_downstream, side, err,
+                 error);
+    this->close();
+}
+
+
+void SSLConnection::checkHandshake(Side& side)
+{
+    if (side.handshaken || !SSL_is_init_finished(side.ssl)) {
+        return;
+    }
+    side.handshaken = true;
+    m_handshaking = (m_client.ssl && !m_client.handshaken) ||
+                    (m_server.ssl && !m_server.handshaken);
+    if (!m_handshaking) {
+        m_trace.handshaken = traceNow();
+    }
+
+    Metrics& metrics = m_worker->metrics();
+    double elapsed = Metrics::since(side.handshakeStart);
+    if (&side == &m_server)
+    {
+        handshakeDone(side.ssl);
+        metrics.handshakeLatency.observe(elapsed);
+        checkKtls(side);
+        m_worker->reportUpstream(this, true);
+    } else {
+        metrics.clientHandshakeLatency.observe(elapsed);
+        if (SSL_session_reused(side.ssl)) {
+            metrics.clientResumed.add();
+        }
+    }
+}
+
+
+void SSLConnection::checkKtls(Side& side)
+{
+    // From here on SSL_write() and SSL_read() in a kTLS direction are
+    // plain system calls, the kernel does the crypto.
+    side.ktlsSend = BIO_get_ktls_send(SSL_get_wbio(side.ssl));
+    side.ktlsRecv = BIO_get_ktls_recv(SSL_get_rbio(side.ssl));
+
+    Metrics& metrics = m_worker->metrics();
+    if (side.ktlsSend) {
+        metrics.ktlsSend.add();
+    }
+    if (side.ktlsRecv) {
+        metrics.ktlsRecv.add();
+    }
+}
@@ -1,11 +1,17 @@
+#ifndef SSL_CONNECTION_H
+#define SSL_CONNECTION_H
+
+#include <string>
+
 #include <sys/types.h>
 #include <sys/socket.h>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
-#include "server.h"
+#include "worker.h"
 #include "selector.h"
+#include "session_cache.h"
 
 
 class SSLException : public std::exception
@@ -33,210 +39,142 @@ public:
 };
 
 
+// Relays a connection of which at least one side speaks TLS: the
+// client side when the proxy terminates TLS, the server side when it
+// talks TLS to the upstream, or both.
+//
+// Like Connection each direction is a Pipe with its own buffer from the
+// worker's pool. It is only read into when empty, so data is always one
+// segment and a retried SSL_write() sees the same buffer. Both
+// pipes share the SSL of a side, and an SSL operation may have to wait
+// for the socket to become readable or writable whatever its own
+// direction, so a Side collects the pipes waiting for each event and
+// runs them all when it fires. Handshakes happen implicitly in the
+// first SSL_read() or SSL_write() on a side. As in Connection a pipe
+// relays until it would block or has spent the worker's byte budget
+// for the wakeup.
+//
+// When the worker has handshake threads, a side that has not finished
+// its handshake hands its SSL to them instead of reading or writing,
+// and its pipes wait for the step to come back as they would for the
+// socket. Closing meanwhile shuts the sockets down, and the object is
+// only destroyed once no step is running.
 class SSLConnection : public IConnection
 {
 private:
-    static SSL_CTX *ctx;
+    static SSL_CTX      *ctx;
+    static SSL_CTX      *serverCtx;
+    static SessionCache *sessions;
 public:
-    static void init(const char* CAfile);
+    // Client side of the upstream connections. A cacheSize of 0
+    // disables session resumption. With ktls OpenSSL hands the record
+    // layer to the kernel after the handshake where the kernel and the
+    // cipher allow it, and stays in userspace otherwise.
+    static void init(const char* CAfile, size_t cacheSize, long cacheLifetime,
+                     bool ktls = false);
     static void free();
 
-private:
-    static const int BUFSIZE = 1024;
-
-    Server   *m_server;
-    Selector *m_selector;
-    
-    SSL *m_ssl;
-
-    int  m_clientSocket;
-    int  m_serverSocket;
-    char m_buf[BUFSIZE];
-    int  m_len;
-
-public:
-    SSLConnection(Server* serv, Selector* sel, int clientSock, int serverSock);
-    ~SSLConnection() = default;
-
-    virtual void close() override;
+    // Server side for terminating TLS from the clients. Resumption uses
+    // session tickets and OpenSSL's server session cache, a cacheSize
+    // of 0 disables both.
+    static void initServer(const char* certFile, const char* keyFile,
+                           size_t cacheSize, long cacheLifetime);
+    static void freeServer();
+
+    // Creates the client side of a TLS connection on sock, offering a
+    // cached session for peer if there is one. The SSL keeps a pointer
+    // to peer, which has to outlive it or be replaced with setPeer().
+    static SSL* newSSL(int sock, const std::string* peer);
+    static void setPeer(SSL* ssl, const std::string* peer);
+    // Counts the handshake as resumed if it was.
+    static void handshakeDone(SSL* ssl);
 
 private:
-    void do_connect_ssl();
-    void do_read();
-    void do_write();
-    void do_read_ssl();
-    void do_write_ssl();
-};
-
-
-SSL_CTX *SSLConnection::ctx = nullptr;
-
-
-void SSLConnection::init(const char* CAfile)
-{
-    OpenSSL_add_ssl_algorithms();
-    SSL_load_error_strings();
-
-    ctx = SSL_CTX_new(TLS_client_method());
-    if (!ctx) {
-        throw SSLException("SSL_CTX_new");
-    }
-
-    if (!SSL_CTX_load_verify_locations(ctx, CAfile, nullptr)) {
-        throw SSLException("Cannot load certificates");
-    }
-}
-
-
-void SSLConnection::free() {
-    SSL_CTX_free(ctx);
-}
-
-
-SSLConnection::SSLConnection(
-    Server* serv, Selector* sel, int clientSock, int serverSock)
-    : m_server(serv), m_selector(sel), 
-      m_clientSocket(clientSock), m_serverSocket(serverSock)
-{
-    m_ssl = SSL_new(ctx);
-    if (!m_ssl) {
-        throw SSLException("SSL_new");
-    }
-
-    if (!SSL_set_fd(m_ssl, serverSock)) {
-        throw SSLException("SSL_set_fd");
-    }
-
-    do_connect_ssl();
-}
-
-
-void SSLConnection::close()
-{
-    shutdown(m_clientSocket, SHUT_RDWR);
-    shutdown(m_serverSocket, SHUT_RDWR);
-    ::close(m_clientSocket);
-    ::close(m_serverSocket);
-    m_server->removeConnection(this);
-}
-
+    using Clock = Metrics::Clock;
 
-void SSLConnection::do_connect_ssl()
-{
-    int ret = SSL_connect(m_ssl);
-    if (ret == 1) {
-        return do_read();
-    }
-
-    int err = SSL_get_error(m_ssl, ret);
-
-    if (err == SSL_ERROR_WANT_READ) {
-        m_selector->addReadEvent(m_serverSocket, [this](int) { 
-            do_connect_ssl(); 
-        });
-    }
-    else if (err == SSL_ERROR_WANT_WRITE) {
-        m_selector->addWriteEvent(m_serverSocket, [this](int) {
-            do_connect_ssl();
-        });
-    }
-    else {
-        throw SSLException("SSL_connect", m_ssl, ret);
-    }
-}
-
-
-void SSLConnection::do_read()
-{
-    m_selector->addReadEvent(m_clientSocket, 
-    [this](int sock) 
+    struct Side
     {
-        m_len = recv(sock, m_buf, BUFSIZE, 0);
-
-        if (m_len > 0) {
-            return do_write_ssl();
-        }
-
-        if (m_len == 0) {
-            // SSL shutdown
-            this->close();
-        }
-
-        if (m_len < 0) {
-            this->close();
-        } 
-    });
-}
-
-
-void SSLConnection::do_write()
-{
-    m_selector->addWriteEvent(m_clientSocket,
-    [this](int sock)
+        int               sock;
+        SSL              *ssl        = nullptr;
+        bool              handshaken = false;
+        bool              ktlsSend   = false;
+        bool              ktlsRecv   = false;
+        Clock::time_point handshakeStart;
+        int               waitRead   = 0; // pipes waiting for readable
+        int               waitWrite  = 0; // pipes waiting for writable
+        int               waitHandshake = 0; // pipes waiting for a step
+        bool              offloaded  = false; // SSL is on a handshake thread
+        bool              shutPending = false; // until the step is back
+
+        explicit Side(int sock) : sock(sock) {}
+    };
+
+    struct Pipe
     {
-        m_len = send(sock, m_buf, m_len, 0);
-        if (m_len > 0) {
-            return do_read();
-        }
-
-        if (m_len == 0) {
-            // SSL shutdown
-            this->close();
-        }    
+        int    id;           // bit in Side::waitRead and waitWrite
+        Side  *from;
+        Side  *to;
+        RelayBuffer buf;
+        bool   eof  = false; // from will not send anything else
+        bool   shut = false; // to has been shut down for writing
+        size_t total = 0;
+        Side  *blockedOn = nullptr; // the side an operation waits for
+        int    blockedFor = 0;      // and the event it waits for
+
+        Pipe(int id, Side* from, Side* to, BufferPool* pool)
+            : id(id), from(from), to(to), buf(pool) {}
+
+        bool wantsRead() const noexcept { return !eof && buf.empty(); }
+        bool wantsWrite() const noexcept { return !buf.empty(); }
+        bool done() const noexcept { return eof && !wantsWrite(); }
+    };
+
+    static const int UPSTREAM   = 1;
+    static const int DOWNSTREAM = 2;
+
+    // Pipe::blockedFor of a pipe waiting for a handshake step.
+    static const int HANDSHAKE = 0;
+
+    Worker   *m_worker;
+    Selector *m_selector;
 
-        if (m_len < 0) {
-            this->close();
-        }
-    });
-}
+    const std::string& m_peer;
 
+    Side m_client;
+    Side m_server;
+    Pipe m_upstream;   // client -> server
+    Pipe m_downstream; // server -> client
 
-void SSLConnection::do_read_ssl()
-{
-    int n = SSL_read(m_ssl, m_buf, BUFSIZE);
-    if (n > 0) {
-        m_len = n;
-        return do_write();
-    }
-    
-    int err = SSL_get_error(m_ssl, n);
+    bool m_closing = false;
 
-    if (err == SSL_ERROR_WANT_READ) {
-        m_selector->addReadEvent(m_serverSocket, [this](int) {
-            do_read_ssl();
-        });
-    }
-    else if (err == SSL_ERROR_WANT_WRITE) {
-        m_selector->addWriteEvent(m_serverSocket, [this](int) {
-            do_read_ssl();
-        });
-    }
-    else {
-        throw SSLException("SSL_read", m_ssl, n);
-    }
-}
+public:
+    // clientTLS terminates TLS from the client, serverTLS talks TLS to
+    // the upstream. A non-null serverSSL has finished its handshake
+    // already.
+    SSLConnection(Worker* worker, Selector* sel,
+                  int clientSock, int serverSock, const std::string& peer,
+                  bool clientTLS, bool serverTLS, SSL* serverSSL = nullptr);
+    ~SSLConnection();
 
+    virtual void close() override;
 
-void SSLConnection::do_write_ssl()
-{
-    int n = SSL_write(m_ssl, m_buf, m_len);
-    if (n > 0) {
-        return do_read_ssl();
-    }
-    
-    int err = SSL_get_error(m_ssl, n);
+private:
+    static int onNewSession(SSL* ssl, SSL_SESSION* session);
+
+    void do_wait(Pipe& p);
+    void do_ready(Side& side, int event);
+    bool do_relay(Pipe& p);
+
+    bool do_read(Pipe& p);
+    bool do_write(Pipe& p);
+    bool do_ssl_error(Pipe& p, Side& side, int err, unsigned long error = 0);
+    void block(Pipe& p, Side& side, int event);
+    void shutdownWrite(Side& side);
+    bool offload(Pipe& p, Side& side);
+    void do_handshaken(Side& side, int err, unsigned long error, double wait);
+    void finish();
+    void checkHandshake(Side& side);
+    void checkKtls(Side& side);
+};
 
-    if (err == SSL_ERROR_WANT_READ) {
-        m_selector->addReadEvent(m_serverSocket, [this](int) {
-            do_write_ssl();
-        });
-    }
-    else if (err == SSL_ERROR_WANT_WRITE) {
-        m_selector->addWriteEvent(m_serverSocket, [this](int) {
-            do_write_ssl();
-        });
-    }
-    else {
-        throw SSLException("SSL_write", m_ssl, n);
-    }
-}
\ No newline at end of file
+#endif // SSL_CONNECTION_H
@@ -1,9 +1,12 @@
 #include <iostream>
+#include <string>
 #include <thread>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
 #include <unistd.h>
 
 #include <openssl/ssl.h>
@@ -23,14 +26,25 @@ void print_ssl_error(const char* msg, SSL* ssl = nullptr, int errcode = 0)
 }
 
 
-int main()
+int main(int argc, char* argv[])
 {
+    // -q stops printing every message so that the server can keep up
+    // with proxy-bench.
+    bool quiet = argc > 1 && std::string(argv[1]) == "-q";
+
+    // A client that closes right after the handshake, like the proxy's
+    // health probes, must not kill the server with the session tickets.
+    signal(SIGPIPE, SIG_IGN);
+
     int server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (server_socket < 0) {
         perror("socket");
         return 1;
     }
 
+    int on = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
     struct sockaddr_in addr;
     addr.sin_family = AF_INET;
     addr.sin_port = htons(8443);
@@ -41,7 +55,7 @@ int main()
         return 2;
     }
 
-    if (listen(server_socket, 1) < 0) {
+    if (listen(server_socket, 128) < 0) {
         perror("listen");
         return 3;
     }
@@ -73,6 +87,7 @@ int main()
             perror("accept");
             break;
         }
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
 
         SSL *ssl = SSL_new(ctx);
         if (!ssl) {
@@ -85,25 +100,31 @@ int main()
             break;
         }
 
-        int err = SSL_accept(ssl);
-        if (err <= 0) {
-            print_ssl_error("ssl accept", ssl, err);
-            continue;
-        }
-        
-        std::thread th([ssl, sock]() 
+        // The handshake runs on the connection's thread so that a slow
+        // client does not hold up the others.
+        std::thread th([ssl, sock, quiet]() 
         {
+            int err = SSL_accept(ssl);
+            if (err <= 0) {
+                print_ssl_error("ssl accept", ssl, err);
+                SSL_free(ssl);
+                close(sock);
+                return;
+            }
+
             char buf[1024];
             while(true)
             {
-                int n = SSL_read(ssl, buf, 1024);
+                int n = SSL_read(ssl, buf, sizeof(buf) - 1);
                 if (n <= 0) {
                     print_ssl_error("SSL_read", ssl, n);
                     break;
                 }
 
-                buf[n] = 0;
-                std::cout << buf << std::endl;
+                if (!quiet) {
+                    buf[n] = 0;
+                    std::cout << buf << std::endl;
+                }
 
                 n = SSL_write(ssl, buf, n);
                 if (n <= 0) {
@@ -0,0 +1,191 @@
+#include "timer_wheel.h"
+
+
+Timer::~Timer()
+{
+    if (m_wheel) {
+        m_wheel->cancel(*this);
+    }
+}
+
+
+TimerWheel::~TimerWheel()
+{
+    // Timers outliving the wheel must not reach back into it.
+    for (Timer *head : m_slots)
+    {
+        for (Timer *t = head; t; t = t->m_next) {
+            t->m_wheel = nullptr;
+        }
+    }
+}
+
+
+// Bits of x rotated right by n, so that bit n comes first.
+static uint64_t rotate(uint64_t x, unsigned n) noexcept
+{
+    n &= 63;
+    return n ? (x >> n) | (x << (64 - n)) : x;
+}
+
+
+void TimerWheel::start(Timer& timer, uint64_t expires, TimerHandler h)
+{
+    if (timer.m_wheel == this) {
+        unlink(timer);
+    } else {
+        timer.m_wheel = this;
+        ++m_count;
+    }
+    timer.m_handler = std::move(h);
+    timer.m_expires = expires > m_current ? expires : m_current + 1;
+    link(timer);
+}
+
+
+void TimerWheel::cancel(Timer& timer) noexcept
+{
+    if (timer.m_wheel != this) {
+        return;
+    }
+    unlink(timer);
+    timer.m_wheel = nullptr;
+    timer.m_handler = nullptr;
+    --m_count;
+}
+
+
+void TimerWheel::link(Timer& timer) noexcept
+{
+    uint64_t expires = timer.m_expires;
+    uint64_t delta = expires - m_current;
+    if (delta >= RANGE) {
+        expires = m_current + RANGE - 1;
+        delta = RANGE - 1;
+    }
+
+    unsigned level = 0;
+    while (delta >= (uint64_t) SLOTS << (BITS * level)) {
+        ++level;
+    }
+    unsigned slot = (expires >> (BITS * level)) & MASK;
+
+    timer.m_slot = level * SLOTS + slot;
+    Timer *&head = m_slots[timer.m_slot];
+    timer.m_prev = nullptr;
+    timer.m_next = head;
+    if (head) {
+        head->m_prev = &timer;
+    }
+    head = &timer;
+    m_used[level] |= (uint64_t) 1 << slot;
+}
+
+
+void TimerWheel::unlink(Timer& timer) noexcept
+{
+    Timer *&head = m_slots[timer.m_slot];
+    if (timer.m_prev) {
+        timer.m_prev->m_next = timer.m_next;
+    } else {
+        head = timer.m_next;
+    }
+    if (timer.m_next) {
+        timer.m_next->m_prev = timer.m_prev;
+    }
+    if (!head) {
+        uint64_t bit = (uint64_t) 1 << (timer.m_slot & MASK);
+        m_used[timer.m_slot / SLOTS] &= ~bit;
+    }
+    timer.m_prev = timer.m_next = nullptr;
+}
+
+
+void TimerWheel::cascade() noexcept
+{
+    // m_current starts a turn of level 0. The slot of each level whose
+    // span begins here moves down; the next level only if this one
+    // starts a turn as well.
+    for (unsigned level = 1; level < LEVELS; ++level)
+    {
+        unsigned slot = (m_current >> (BITS * level)) & MASK;
+        Timer *t = m_slots[level * SLOTS + slot];
+        m_slots[level * SLOTS + slot] = nullptr;
+        m_used[level] &= ~((uint64_t) 1 << slot);
+
+        while (t) {
+            Timer *next = t->m_next;
+            link(*t);
+            t = next;
+        }
+        if (slot != 0) {
+            break;
+        }
+    }
+}
+
+
+Timer* TimerWheel::expire(uint64_t now) noexcept
+{
+    while (true)
+    {
+        Timer *t = m_slots[m_current & MASK];
+        if (t) {
+            unlink(*t);
+            t->m_wheel = nullptr;
+            --m_count;
+            return t;
+        }
+        if (m_current >= now) {
+            return nullptr;
+        }
+        if (m_count == 0) {
+            m_current = now;
+            return nullptr;
+        }
+
+        // On to the next level 0 slot in use before the end of this
+        // turn, or to the start of the next turn.
+        unsigned pos = m_current & MASK;
+        uint64_t later = pos == MASK
+            ? 0 : m_used[0] & (~(uint64_t) 0 << (pos + 1));
+        uint64_t turn = (m_current | MASK) + 1;
+        uint64_t tick = later
+            ? (m_current & ~(uint64_t) MASK) + __builtin_ctzll(later) : turn;
+        if (tick > now) {
+            m_current = now;
+            return nullptr;
+        }
+        m_current = tick;
+        if (tick == turn) {
+            cascade();
+        }
+    }
+}
+
+
+uint64_t TimerWheel::next() const noexcept
+{
+    if (m_count == 0) {
+        return UINT64_MAX;
+    }
+    if (m_slots[m_current & MASK]) {
+        return m_current;
+    }
+
+    uint64_t first = UINT64_MAX;
+    for (unsigned level = 0; level < LEVELS; ++level)
+    {
+        if (!m_used[level]) {
+            continue;
+        }
+        // The spans of this level after the current one, in order.
+        uint64_t span = (m_current >> (BITS * level)) + 1;
+        uint64_t used = rotate(m_used[level], span & MASK);
+        uint64_t tick = (span + __builtin_ctzll(used)) << (BITS * level);
+        if (tick < first) {
+            first = tick;
+        }
+    }
+    return first;
+}
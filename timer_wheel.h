@@ -0,0 +1,94 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <cstdint>
+
+#include "inplace_function.h"
+
+
+using TimerHandler = InplaceFunction<void ()>;
+
+class TimerWheel;
+
+
+// A timer owned by its user, typically a member of the object it times
+// out. It is linked into the wheel while it runs, so arming, cancelling
+// and arming it again are O(1) and never allocate. It must not move
+// while it runs; destroying it cancels it.
+class Timer
+{
+    friend class TimerWheel;
+
+    TimerWheel  *m_wheel = nullptr; // while it runs
+    Timer       *m_prev  = nullptr;
+    Timer       *m_next  = nullptr;
+    uint64_t     m_expires = 0;     // tick
+    unsigned     m_slot  = 0;       // level * SLOTS + slot
+    TimerHandler m_handler;
+
+public:
+    Timer() = default;
+    ~Timer();
+
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+
+    bool running() const noexcept { return m_wheel != nullptr; }
+};
+
+
+// Hierarchical timing wheel with millisecond ticks, after Varghese and
+// Lauck: LEVELS wheels of SLOTS slots, each level SLOTS times coarser
+// than the one below. A timer goes into the finest level whose range
+// covers its delay and moves down a level (cascades) when the lower
+// wheel has turned once, so it fires from level 0 on its exact tick.
+// Timers further out than the top level's range, about 4.6 hours,
+// wait in its last slot and are placed again when it cascades.
+//
+// A bitmap of the slots in use per level lets expire() skip empty
+// ticks and next() find the first tick worth waking up for.
+class TimerWheel
+{
+    static const unsigned BITS   = 6;
+    static const unsigned SLOTS  = 1 << BITS;
+    static const unsigned MASK   = SLOTS - 1;
+    static const unsigned LEVELS = 4;
+    static const uint64_t RANGE  = (uint64_t) 1 << (BITS * LEVELS);
+
+    Timer    *m_slots[LEVELS * SLOTS] = {};
+    uint64_t  m_used[LEVELS] = {};  // bitmap of non-empty slots
+    uint64_t  m_current = 0;        // the tick being expired
+    size_t    m_count = 0;
+
+public:
+    TimerWheel() = default;
+    ~TimerWheel();
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    // Runs the timer on tick expires, which is moved to the next tick if
+    // it has passed. A running timer is moved.
+    void start(Timer& timer, uint64_t expires, TimerHandler h);
+    void cancel(Timer& timer) noexcept;
+
+    // Unlinks and returns a timer due at or before now, nullptr when
+    // there is none left. Its handler is for the caller to run.
+    Timer* expire(uint64_t now) noexcept;
+    TimerHandler take(Timer& timer) noexcept {
+        return std::move(timer.m_handler);
+    }
+
+    // The first tick a timer may expire on, or UINT64_MAX without any.
+    // Higher levels only tell when they cascade, which comes earlier.
+    uint64_t next() const noexcept;
+
+    size_t size() const noexcept { return m_count; }
+
+private:
+    void link(Timer& timer) noexcept;
+    void unlink(Timer& timer) noexcept;
+    void cascade() noexcept;
+};
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,116 @@
+#include <cinttypes>
+#include <cstdio>
+
+#include "trace.h"
+
+
+TraceRing::TraceRing(size_t size)
+    : m_mask(0)
+{
+    if (size == 0) {
+        return;
+    }
+    size_t slots = 1;
+    while (slots < size) {
+        slots *= 2;
+    }
+    m_slots.reset(new Slot[slots]);
+    m_mask = slots - 1;
+}
+
+
+static uint64_t since(uint64_t start, uint64_t t) noexcept {
+    return t ? t - start : TraceRecord::NONE;
+}
+
+
+void TraceRing::push(const ConnectionTrace& trace, uint32_t backend) noexcept
+{
+    uint64_t now = traceNow();
+    uint64_t wall = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+
+    uint64_t head = m_head.load(std::memory_order_relaxed);
+    Slot& slot = m_slots[head & m_mask];
+    slot.seq.store(2 * head + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    TraceRecord& r = slot.record;
+    r.start     = wall - (now - trace.accepted);
+    r.connect   = since(trace.accepted, trace.connected);
+    r.handshake = since(trace.accepted, trace.handshaken);
+    r.firstUp   = since(trace.accepted, trace.firstUp);
+    r.firstDown = since(trace.accepted, trace.firstDown);
+    r.duration  = now - trace.accepted;
+    r.bytesUp   = trace.bytesUp;
+    r.bytesDown = trace.bytesDown;
+    r.backend   = backend;
+
+    slot.seq.store(2 * head + 2, std::memory_order_release);
+    m_head.store(head + 1, std::memory_order_release);
+}
+
+
+void TraceRing::read(std::vector<TraceRecord>& out) const
+{
+    uint64_t head = m_head.load(std::memory_order_acquire);
+    uint64_t size = enabled() ? m_mask + 1 : 0;
+    for (uint64_t i = head > size ? head - size : 0; i < head; ++i)
+    {
+        const Slot& slot = m_slots[i & m_mask];
+        uint64_t seq = 2 * i + 2;
+        if (slot.seq.load(std::memory_order_acquire) != seq) {
+            continue;
+        }
+        TraceRecord record = slot.record;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) == seq) {
+            out.push_back(record);
+        }
+    }
+}
+
+
+// Microseconds, or null for a step the connection did not get to.
+static void field(std::string& out, const char* name, uint64_t us)
+{
+    char buf[64];
+    if (us != TraceRecord::NONE) {
+        snprintf(buf, sizeof(buf), ",\"%s\":%" PRIu64, name, us);
+    } else {
+        snprintf(buf, sizeof(buf), ",\"%s\":null", name);
+    }
+    out += buf;
+}
+
+
+void writeTraces(std::string& out, const std::vector<const TraceRing*>& all,
+                 const std::vector<std::string>& backends)
+{
+    std::vector<TraceRecord> records;
+    for (size_t worker = 0; worker < all.size(); ++worker)
+    {
+        records.clear();
+        all[worker]->read(records);
+        for (auto& r : records)
+        {
+            char buf[256];
+            snprintf(buf, sizeof(buf),
+                     "{\"worker\":%zu,\"start\":%" PRIu64 ".%06" PRIu64
+                     ",\"backend\":\"%s\"", worker, r.start / 1000000,
+                     r.start % 1000000,
+                     r.backend < backends.size()
+                         ? backends[r.backend].c_str() : "");
+            out += buf;
+            field(out, "connect_us", r.connect);
+            field(out, "handshake_us", r.handshake);
+            field(out, "first_up_us", r.firstUp);
+            field(out, "first_down_us", r.firstDown);
+            snprintf(buf, sizeof(buf),
+                     ",\"duration_us\":%" PRIu64 ",\"bytes_up\":%" PRIu64
+                     ",\"bytes_down\":%" PRIu64 "}\n",
+                     r.duration, r.bytesUp, r.bytesDown);
+            out += buf;
+        }
+    }
+}
@@ -0,0 +1,91 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+// Microseconds of the monotonic clock, which connection traces are
+// stamped with.
+inline uint64_t traceNow() noexcept
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+// What a connection went through, in traceNow() microseconds; 0 for
+// the steps it did not get to.
+struct ConnectionTrace
+{
+    uint64_t accepted   = 0;
+    uint64_t connected  = 0; // to the upstream
+    uint64_t handshaken = 0; // the last TLS handshake finished
+    uint64_t firstUp    = 0; // first byte relayed client -> server
+    uint64_t firstDown  = 0; // first byte relayed server -> client
+    uint64_t bytesUp    = 0;
+    uint64_t bytesDown  = 0;
+};
+
+
+// A closed connection as kept in a TraceRing: the wall clock time it
+// was accepted at, the other steps in microseconds since then or NONE.
+struct TraceRecord
+{
+    static const uint64_t NONE = UINT64_MAX;
+
+    uint64_t start;     // microseconds since the epoch
+    uint64_t connect;
+    uint64_t handshake;
+    uint64_t firstUp;
+    uint64_t firstDown;
+    uint64_t duration;
+    uint64_t bytesUp;
+    uint64_t bytesDown;
+    uint32_t backend;
+};
+
+
+// The last closed connections of one worker. Only the worker writes,
+// one record per connection at close, and never waits: the oldest
+// record is overwritten. Every slot is a seqlock, so a reader on
+// another thread copies the records without stopping the worker and
+// skips those that are being overwritten under it.
+class TraceRing
+{
+    struct Slot
+    {
+        std::atomic<uint64_t> seq{0}; // odd while the record is written
+        TraceRecord           record;
+    };
+
+    std::unique_ptr<Slot[]> m_slots;
+    size_t                  m_mask;
+    std::atomic<uint64_t>   m_head{0}; // records written so far
+
+public:
+    // Keeps size records rounded up to a power of two, 0 disables it.
+    explicit TraceRing(size_t size);
+
+    TraceRing(const TraceRing&) = delete;
+    TraceRing& operator=(const TraceRing&) = delete;
+
+    bool enabled() const noexcept { return m_slots != nullptr; }
+
+    void push(const ConnectionTrace& trace, uint32_t backend) noexcept;
+    // Appends the records still in the ring, oldest first.
+    void read(std::vector<TraceRecord>& out) const;
+};
+
+
+// Appends the records of every ring as JSON lines, with the worker and
+// the backend spelt out.
+void writeTraces(std::string& out, const std::vector<const TraceRing*>& all,
+                 const std::vector<std::string>& backends);
+
+#endif // TRACE_H
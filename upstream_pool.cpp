@@ -0,0 +1,272 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "upstream_pool.h"
+#include "ssl_connection.h"
+#include "net.h"
+
+
+UpstreamPool::UpstreamPool(const Config& config, Selector* sel, bool tls,
+                           Balancer* balancer, size_t backend,
+                           Metrics* metrics)
+    : m_config(config), m_selector(sel), m_tls(tls), m_balancer(balancer),
+      m_backend(backend),
+      m_metrics(metrics),
+      m_entries(Entries::allocator_type(&m_nodes)),
+      m_target(std::min(config.poolMin, config.poolMax)), m_failing(false) {}
+
+
+UpstreamPool::~UpstreamPool()
+{
+    for (auto& [sock, entry] : m_entries)
+    {
+        if (entry.ssl) {
+            SSL_free(entry.ssl);
+        }
+        m_selector->removeEvents(sock);
+        close(sock);
+    }
+}
+
+
+void UpstreamPool::start()
+{
+    fill();
+    m_selector->addTimer(SWEEP_MS, [this] { sweep(); });
+}
+
+
+bool UpstreamPool::acquire(Upstream& up)
+{
+    if (m_ready.empty()) {
+        m_target = std::min(m_target + 1, m_config.poolMax);
+        fill();
+        return false;
+    }
+
+    up.sock = m_ready.back();
+    m_ready.pop_back();
+
+    auto iter = m_entries.find(up.sock);
+    up.ssl = iter->second.ssl;
+    m_entries.erase(iter);
+
+    // The registration stays, the connection takes the socket over.
+    m_selector->cancelEvents(up.sock);
+    fill();
+    return true;
+}
+
+
+void UpstreamPool::fill()
+{
+    while (!m_failing && m_entries.size() < m_target) {
+        do_connect();
+    }
+}
+
+
+void UpstreamPool::sweep()
+{
+    auto idle = std::chrono::seconds(m_config.poolIdleTimeout);
+    auto now = Clock::now();
+
+    while (!m_ready.empty() && m_entries.size() > m_config.poolMin)
+    {
+        int sock = m_ready.front();
+        if (now - m_entries[sock].since < idle) {
+            break;
+        }
+        evict(sock);
+        m_target = std::max(m_target, m_config.poolMin + 1) - 1;
+    }
+
+    auto connectTimeout = std::chrono::milliseconds(m_config.connectTimeout);
+    auto handshakeTimeout =
+        std::chrono::milliseconds(m_config.handshakeTimeout);
+    for (auto iter = m_entries.begin(); iter != m_entries.end(); )
+    {
+        int sock = iter->first;
+        const Entry& entry = iter->second;
+        ++iter;
+        if (entry.ready) {
+            continue;
+        }
+        if (!entry.ssl && m_config.connectTimeout > 0 &&
+            now - entry.since >= connectTimeout)
+        {
+            m_metrics->connectErrors.add();
+            m_metrics->connectTimeouts.add();
+            fail(sock);
+        }
+        else if (entry.ssl && m_config.handshakeTimeout > 0 &&
+                 now - entry.since >= handshakeTimeout)
+        {
+            m_metrics->handshakeTimeouts.add();
+            fail(sock);
+        }
+    }
+
+    m_failing = false;
+    fill();
+    m_selector->addTimer(SWEEP_MS, [this] { sweep(); });
+}
+
+
+void UpstreamPool::do_connect()
+{
+    const Balancer::Backend& backend = (*m_balancer)[m_backend];
+    int sock = createNonblockingSocket(backend.address().family());
+    // Told once per worker, like the workers' own sockets.
+    if (sock >= 0 && !tuneUpstreamSocket(sock, m_config.socketOptions)) {
+        if (m_metrics->socketOptionErrors.value() == 0) {
+            perror("setsockopt");
+        }
+        m_metrics->socketOptionErrors.add();
+    }
+    if (sock < 0) {
+        m_failing = true;
+        return;
+    }
+
+    int err = connect(sock, backend.address());
+    if (err != 0 && err != EINPROGRESS) {
+        m_metrics->connectErrors.add();
+        m_balancer->failed(m_backend);
+        close(sock);
+        m_failing = true;
+        return;
+    }
+    m_entries[sock].since = Clock::now();
+
+    m_selector->addWriteEvent(sock, [this](int sock)
+    {
+        if (getConnectResult(sock) != 0) {
+            m_metrics->connectErrors.add();
+            return fail(sock);
+        }
+        Entry& entry = m_entries[sock];
+        m_metrics->connectLatency.observe(Metrics::since(entry.since));
+        entry.since = Clock::now();
+
+        if (!m_tls) {
+            m_balancer->succeeded(m_backend);
+            return makeReady(sock);
+        }
+        try {
+            entry.ssl = SSLConnection::newSSL(sock,
+                                              &(*m_balancer)[m_backend].peer);
+        }
+        catch (SSLException&) {
+            return fail(sock);
+        }
+        do_handshake(sock);
+    });
+}
+
+
+void UpstreamPool::do_handshake(int sock)
+{
+    Entry& entry = m_entries[sock];
+    SSL *ssl = entry.ssl;
+
+    int ret = SSL_connect(ssl);
+    if (ret == 1) {
+        SSLConnection::handshakeDone(ssl);
+        m_metrics->handshakeLatency.observe(Metrics::since(entry.since));
+        m_balancer->succeeded(m_backend);
+        return makeReady(sock);
+    }
+
+    int err = SSL_get_error(ssl, ret);
+
+    if (err == SSL_ERROR_WANT_READ) {
+        m_selector->wouldBlock(sock, POLLIN);
+        m_selector->addReadEvent(sock, [this](int sock) {
+            do_handshake(sock);
+        });
+    }
+    else if (err == SSL_ERROR_WANT_WRITE) {
+        m_selector->wouldBlock(sock, POLLOUT);
+        m_selector->addWriteEvent(sock, [this](int sock) {
+            do_handshake(sock);
+        });
+    }
+    else {
+        fail(sock);
+    }
+}
+
+
+void UpstreamPool::do_watch(int sock)
+{
+    // An idle upstream should stay silent. It becomes readable when it
+    // closes the connection, or with TLS 1.3 when it sends a session
+    // ticket, which SSL_peek() processes. If it really sends data (a
+    // server-first protocol) the data is left for the client and the
+    // socket is not watched anymore.
+    m_selector->addReadEvent(sock, [this](int sock)
+    {
+        SSL *ssl = m_entries[sock].ssl;
+        char c;
+
+        int n = ssl ? SSL_peek(ssl, &c, 1) : recv(sock, &c, 1, MSG_PEEK);
+        if (n > 0) {
+            return;
+        }
+
+        bool wouldBlock = ssl
+            ? n < 0 && SSL_get_error(ssl, n) == SSL_ERROR_WANT_READ
+            : n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        if (!wouldBlock) {
+            evict(sock);
+            return fill();
+        }
+        m_selector->wouldBlock(sock, POLLIN);
+        do_watch(sock);
+    });
+}
+
+
+void UpstreamPool::makeReady(int sock)
+{
+    Entry& entry = m_entries[sock];
+    entry.since = Clock::now();
+    entry.ready = true;
+    m_ready.push_back(sock);
+    m_failing = false;
+    do_watch(sock);
+}
+
+
+void UpstreamPool::evict(int sock)
+{
+    auto iter = m_entries.find(sock);
+    if (iter == m_entries.end()) {
+        return;
+    }
+    if (iter->second.ssl) {
+        SSL_free(iter->second.ssl);
+    }
+    m_entries.erase(iter);
+
+    auto ready = std::find(m_ready.begin(), m_ready.end(), sock);
+    if (ready != m_ready.end()) {
+        m_ready.erase(ready);
+    }
+
+    m_selector->removeEvents(sock);
+    close(sock);
+}
+
+
+void UpstreamPool::fail(int sock)
+{
+    evict(sock);
+    m_balancer->failed(m_backend);
+    m_failing = true;
+}
@@ -0,0 +1,89 @@
+#ifndef UPSTREAM_POOL_H
+#define UPSTREAM_POOL_H
+
+#include <chrono>
+#include <deque>
+#include <map>
+#include <string>
+
+#include <openssl/ssl.h>
+
+#include "balancer.h"
+#include "config.h"
+#include "metrics.h"
+#include "selector.h"
+#include "slab_pool.h"
+
+
+// A connected upstream socket; ssl is set and past its handshake when
+// the upstream speaks TLS.
+struct Upstream
+{
+    int  sock = -1;
+    SSL *ssl  = nullptr;
+};
+
+
+// Keeps connections to one backend open ahead of time, so that an
+// accepted client is paired with one at once instead of waiting for a
+// connect and a TLS handshake. A worker has a pool per backend.
+//
+// The pool starts with poolMin connections, grows by one on every miss
+// up to poolMax and shrinks back to poolMin by closing connections that
+// were idle longer than poolIdleTimeout. Idle connections are watched:
+// one the upstream closes is evicted and replaced. After a failed
+// connect new ones are only tried on the next sweep, which also fails
+// connects and handshakes that ran past their timeouts. Connects and
+// handshakes are reported to the balancer as health.
+class UpstreamPool
+{
+    static const int SWEEP_MS = 1000;
+
+    using Clock = std::chrono::steady_clock;
+
+    struct Entry
+    {
+        SSL              *ssl = nullptr;
+        Clock::time_point since; // of the connect, handshake or idle time
+        bool              ready = false;
+    };
+
+    const Config&      m_config;
+    Selector          *m_selector;
+    bool               m_tls;
+    Balancer          *m_balancer;
+    size_t             m_backend; // index in m_balancer
+    Metrics           *m_metrics;
+
+    using Entries = std::map<int, Entry, std::less<int>,
+        SlabAllocator<std::pair<const int, Entry>>>;
+
+    SlabPool             m_nodes;
+    Entries              m_entries;
+    std::deque<int>      m_ready; // the longest idle first
+    size_t               m_target;
+    bool                 m_failing;
+
+public:
+    UpstreamPool(const Config& config, Selector* sel, bool tls,
+                 Balancer* balancer, size_t backend, Metrics* metrics);
+    ~UpstreamPool();
+
+    void start();
+    // Takes a ready connection out of the pool if there is one.
+    bool acquire(Upstream& up);
+
+private:
+    void fill();
+    void sweep();
+
+    void do_connect();
+    void do_handshake(int sock);
+    void do_watch(int sock);
+
+    void makeReady(int sock);
+    void evict(int sock);
+    void fail(int sock);
+};
+
+#endif // UPSTREAM_POOL_H
@@ -0,0 +1,355 @@
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring_poller.h"
+
+
+// user_data of a request: operations carry their id, polls the
+// descriptor and the generation of the watch, and requests whose
+// completion nobody needs are marked as ignored.
+static const uint64_t OPERATION = 1ULL << 63;
+static const uint64_t IGNORED   = 1ULL << 62;
+static const uint32_t GEN_MASK  = 0x3fffffff;
+
+static uint64_t pollData(int sock, uint32_t gen) {
+    return (uint64_t) gen << 32 | (uint32_t) sock;
+}
+
+
+UringPoller::UringPoller()
+    : m_fd(-1), m_rings(MAP_FAILED), m_ringsSize(0),
+      m_sqes((io_uring_sqe*) MAP_FAILED), m_sqesSize(0), m_sqLocalTail(0)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    params.cq_entries = 4 * ENTRIES;
+
+    m_fd = syscall(__NR_io_uring_setup, ENTRIES, &params);
+    if (m_fd < 0) {
+        perror("io_uring_setup");
+        throw 28;
+    }
+
+    const unsigned required =
+        IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & required) != required) {
+        fprintf(stderr, "io_uring: the kernel is too old\n");
+        close(m_fd);
+        throw 28;
+    }
+
+    m_ringsSize = std::max(
+        params.sq_off.array + params.sq_entries * sizeof(unsigned),
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    m_rings = mmap(nullptr, m_ringsSize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if (m_rings == MAP_FAILED) {
+        perror("mmap");
+        close(m_fd);
+        throw 28;
+    }
+
+    m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    m_sqes = (io_uring_sqe*) mmap(nullptr, m_sqesSize,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd,
+        IORING_OFF_SQES);
+    if (m_sqes == MAP_FAILED) {
+        perror("mmap");
+        munmap(m_rings, m_ringsSize);
+        close(m_fd);
+        throw 28;
+    }
+
+    char *rings = static_cast<char*>(m_rings);
+    m_sqHead    = (unsigned*) (rings + params.sq_off.head);
+    m_sqTail    = (unsigned*) (rings + params.sq_off.tail);
+    m_sqArray   = (unsigned*) (rings + params.sq_off.array);
+    m_sqMask    = *(unsigned*) (rings + params.sq_off.ring_mask);
+    m_sqEntries = params.sq_entries;
+    m_sqLocalTail = *m_sqTail;
+
+    m_cqHead = (unsigned*) (rings + params.cq_off.head);
+    m_cqTail = (unsigned*) (rings + params.cq_off.tail);
+    m_cqMask = *(unsigned*) (rings + params.cq_off.ring_mask);
+    m_cqes   = (io_uring_cqe*) (rings + params.cq_off.cqes);
+}
+
+
+UringPoller::~UringPoller()
+{
+    munmap(m_sqes, m_sqesSize);
+    munmap(m_rings, m_ringsSize);
+    close(m_fd);
+}
+
+
+io_uring_sqe* UringPoller::getSqe()
+{
+    unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+    if (m_sqLocalTail - head >= m_sqEntries)
+    {
+        // The queue is full, hand it to the kernel without waiting.
+        enter(0, 0);
+        head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+        if (m_sqLocalTail - head >= m_sqEntries) {
+            fprintf(stderr, "io_uring: submission queue full\n");
+            throw 28;
+        }
+    }
+
+    unsigned index = m_sqLocalTail & m_sqMask;
+    io_uring_sqe *sqe = &m_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    m_sqArray[index] = index;
+    ++m_sqLocalTail;
+    return sqe;
+}
+
+
+int UringPoller::enter(unsigned minComplete, int timeoutMs)
+{
+    __atomic_store_n(m_sqTail, m_sqLocalTail, __ATOMIC_RELEASE);
+    unsigned toSubmit =
+        m_sqLocalTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeoutMs / 1000;
+    ts.tv_nsec = (timeoutMs % 1000) * 1000000L;
+
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = timeoutMs < 0 ? 0 : (uint64_t) &ts; // no timeout: forever
+
+    unsigned flags = IORING_ENTER_EXT_ARG;
+    if (minComplete) {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+
+    int ret = syscall(__NR_io_uring_enter, m_fd, toSubmit, minComplete,
+                      flags, &arg, sizeof(arg));
+    if (ret < 0 && (errno == ETIME || errno == EBUSY || errno == EAGAIN)) {
+        return 0;
+    }
+    return ret;
+}
+
+
+void UringPoller::markDirty(int sock)
+{
+    Watch& w = m_watches[sock];
+    if (!w.dirty) {
+        w.dirty = true;
+        m_dirty.push_back(sock);
+    }
+}
+
+
+void UringPoller::add(int sock, int events)
+{
+    if (sock >= (int) m_watches.size()) {
+        m_watches.resize(sock + 1);
+    }
+    m_watches[sock].registered = true;
+    m_watches[sock].interest = events;
+    markDirty(sock);
+}
+
+
+void UringPoller::modify(int sock, int events) {
+    add(sock, events);
+}
+
+
+void UringPoller::remove(int sock)
+{
+    if (sock >= (int) m_watches.size() || !m_watches[sock].registered) {
+        return;
+    }
+    Watch& w = m_watches[sock];
+
+    // The poll holds a reference to the socket, it has to go before
+    // the descriptor is closed and reused.
+    if (w.armed) {
+        io_uring_sqe *sqe = getSqe();
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = pollData(sock, w.gen);
+        sqe->user_data = IGNORED;
+    }
+    w.registered = false;
+    w.interest = 0;
+    w.armed = 0;
+    w.gen = (w.gen + 1) & GEN_MASK;
+}
+
+
+void UringPoller::arm(int sock)
+{
+    Watch& w = m_watches[sock];
+    w.dirty = false;
+    if (!w.registered || w.armed == w.interest) {
+        return;
+    }
+
+    if (w.armed) {
+        io_uring_sqe *sqe = getSqe();
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = pollData(sock, w.gen);
+        sqe->user_data = IGNORED;
+        w.armed = 0;
+    }
+    w.gen = (w.gen + 1) & GEN_MASK;
+    if (!w.interest) {
+        return;
+    }
+
+    io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = sock;
+    sqe->poll32_events = w.interest;
+    sqe->user_data = pollData(sock, w.gen);
+    w.armed = w.interest;
+}
+
+
+void UringPoller::accept(int sock, uint32_t id)
+{
+    io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sock;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = OPERATION | id;
+}
+
+
+void UringPoller::connect(int sock, const struct sockaddr* addr,
+                          socklen_t len, uint32_t id)
+{
+    io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = sock;
+    sqe->addr = (uint64_t) addr;
+    sqe->off = len;
+    sqe->user_data = OPERATION | id;
+}
+
+
+void UringPoller::recv(int sock, void* buf, size_t len, uint32_t id)
+{
+    io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sock;
+    sqe->addr = (uint64_t) buf;
+    sqe->len = len;
+    sqe->user_data = OPERATION | id;
+}
+
+
+void UringPoller::send(int sock, const void* buf, size_t len, uint32_t id)
+{
+    io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = sock;
+    sqe->addr = (uint64_t) buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = OPERATION | id;
+}
+
+
+void UringPoller::cancelAll()
+{
+    io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    sqe->user_data = IGNORED;
+}
+
+
+void UringPoller::cancel(int sock)
+{
+    io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = sock;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = IGNORED;
+}
+
+
+int UringPoller::wait(std::vector<ReadyEvent>& ready, int timeoutMs)
+{
+    ready.clear();
+    m_completions.clear();
+
+    for (int sock : m_dirty) {
+        arm(sock);
+    }
+    m_dirty.clear();
+
+    bool completed = *m_cqHead != __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+    unsigned minComplete = completed || timeoutMs == 0 ? 0 : 1;
+    bool queued = m_sqLocalTail != __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+
+    if (queued || minComplete) {
+        if (enter(minComplete, timeoutMs) < 0) {
+            return -1;
+        }
+    }
+
+    reap(ready);
+    return ready.size() + m_completions.size();
+}
+
+
+void UringPoller::reap(std::vector<ReadyEvent>& ready)
+{
+    unsigned head = *m_cqHead;
+    unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; ++head)
+    {
+        const io_uring_cqe& cqe = m_cqes[head & m_cqMask];
+
+        if (cqe.user_data & OPERATION) {
+            m_completions.push_back({(uint32_t) cqe.user_data, cqe.res});
+            continue;
+        }
+        if (cqe.user_data & IGNORED) {
+            continue;
+        }
+
+        int sock = (int) (uint32_t) cqe.user_data;
+        uint32_t gen = cqe.user_data >> 32;
+        if (sock >= (int) m_watches.size()) {
+            continue;
+        }
+        Watch& w = m_watches[sock];
+        if (!w.registered || !w.armed || w.gen != gen) {
+            continue;
+        }
+
+        // One-shot: the poll is armed again by the next wait().
+        w.armed = 0;
+        markDirty(sock);
+        if (cqe.res > 0) {
+            ready.push_back({sock, cqe.res});
+        } else if (cqe.res < 0 && cqe.res != -ECANCELED) {
+            ready.push_back({sock, POLLERR});
+        }
+    }
+
+    __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,111 @@
+#ifndef URING_POLLER_H
+#define URING_POLLER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "poller.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+
+// Poller on top of io_uring, driven with the raw system calls.
+//
+// Readiness is watched with one-shot IORING_OP_POLL_ADD requests that
+// are armed again on the next wait() while there is interest, which
+// behaves like level-triggered poll(2). Besides readiness it runs
+// accept, connect, recv and send as asynchronous operations; their
+// results come back from wait() as completions tagged with the id the
+// caller gave.
+//
+// Nothing reaches the kernel before wait(): everything queued since the
+// last call is submitted by the same io_uring_enter(2) that waits for
+// the next completions.
+class UringPoller : public Poller
+{
+public:
+    struct Completion
+    {
+        uint32_t id;
+        int      res; // the system call's result or a negative errno
+    };
+
+private:
+    static const unsigned ENTRIES = 1024;
+
+    struct Watch
+    {
+        bool     registered = false;
+        bool     dirty      = false; // queued for arm()
+        int      interest   = 0;
+        int      armed      = 0;     // events of the pending poll
+        uint32_t gen        = 0;     // tells pending polls from old ones
+    };
+
+    int    m_fd;
+    void  *m_rings;
+    size_t m_ringsSize;
+
+    io_uring_sqe *m_sqes;
+    size_t        m_sqesSize;
+    unsigned     *m_sqHead;
+    unsigned     *m_sqTail;
+    unsigned     *m_sqArray;
+    unsigned      m_sqMask;
+    unsigned      m_sqEntries;
+    unsigned      m_sqLocalTail;
+
+    io_uring_cqe *m_cqes;
+    unsigned     *m_cqHead;
+    unsigned     *m_cqTail;
+    unsigned      m_cqMask;
+
+    std::vector<Watch>      m_watches; // indexed by descriptor
+    std::vector<int>        m_dirty;
+    std::vector<Completion> m_completions;
+
+public:
+    // Throws when the kernel has no usable io_uring.
+    UringPoller();
+    ~UringPoller();
+
+    UringPoller(const UringPoller&) = delete;
+    UringPoller& operator=(const UringPoller&) = delete;
+
+    virtual void add(int sock, int events) override;
+    virtual void modify(int sock, int events) override;
+    virtual void remove(int sock) override;
+
+    virtual int wait(std::vector<ReadyEvent>& ready, int timeoutMs) override;
+
+    // The buffers and the address have to stay valid until the
+    // operation completes.
+    void accept(int sock, uint32_t id);
+    void connect(int sock, const struct sockaddr* addr, socklen_t len,
+                 uint32_t id);
+    void recv(int sock, void* buf, size_t len, uint32_t id);
+    void send(int sock, const void* buf, size_t len, uint32_t id);
+    // Makes every pending operation complete with -ECANCELED, or only
+    // those on sock.
+    void cancelAll();
+    void cancel(int sock);
+
+    // Completions collected by the last wait().
+    const std::vector<Completion>& completions() const noexcept {
+        return m_completions;
+    }
+
+private:
+    io_uring_sqe* getSqe();
+    int enter(unsigned minComplete, int timeoutMs);
+    void arm(int sock);
+    void markDirty(int sock);
+    void reap(std::vector<ReadyEvent>& ready);
+};
+
+#endif // URING_POLLER_H
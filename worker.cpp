@@ -0,0 +1,706 @@
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <iostream>
+
+#include "worker.h"
+#include "net.h"
+#include "connection.h"
+#include "ssl_connection.h"
+#include "alloc_stats.h"
+
+
+static const size_t CONNECTION_SIZE =
+    std::max(sizeof(Connection), sizeof(SSLConnection));
+
+
+Worker::Worker(const Config& config, unsigned id, Resolver* resolver,
+               HandshakePool* handshakes, Admission* admission)
+    : m_config(config), m_enableSSL(false),
+      m_terminateTLS(!config.certFile.empty()),
+      m_selector(config.backend, &m_metrics), m_listener(-1),
+      m_balancer(config.backends, config.balancing, config.ejectFailures,
+                 config.ejectBackoff, id, &m_metrics),
+      m_resolver(resolver), m_handshakes(handshakes),
+      m_admission(admission), m_reserve(-1),
+      m_buffers(config.highWatermark, config.lowWatermark),
+      m_traces(config.traceSize),
+      m_connectionPool(CONNECTION_SIZE), m_connections(nullptr),
+      m_connectPool(sizeof(Connect)), m_connects(nullptr),
+      m_accepted(0), m_accepting(0), m_draining(false),
+      m_stopping(false) {}
+
+
+void Worker::listenAndServe(bool enableSSL, int listener)
+{
+    m_enableSSL = enableSSL;
+    m_listener = listener;
+    for (size_t i = 0; m_config.poolMax > 0 && i < m_balancer.size(); ++i)
+    {
+        m_pools.emplace_back(
+            new UpstreamPool(m_config, &m_selector, enableSSL,
+                             &m_balancer, i, &m_metrics));
+        m_pools.back()->start();
+    }
+    if (m_config.healthInterval > 0) {
+        m_health.reset(
+            new HealthChecker(m_config, &m_selector, enableSSL, &m_balancer,
+                              &m_metrics));
+        m_health->start();
+    }
+    if (m_resolver) {
+        m_selector.addTimer(m_config.dnsTtl * 1000, [this] { do_refresh(); });
+    }
+
+    m_reserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    unsigned long allocations = threadAllocations();
+
+    // io_uring runs a batch of accepts at once instead.
+    unsigned accepts = m_selector.completions() ? m_config.acceptBatch : 1;
+    for (unsigned i = 0; i < accepts; ++i) {
+        do_accept();
+    }
+    m_selector.run();
+
+    allocations = threadAllocations() - allocations;
+    std::clog << "worker: " << m_accepted << " connections, "
+              << (m_accepted ? (double) allocations / m_accepted : 0.0)
+              << " allocations per connection" << std::endl;
+
+    closeConnections();
+    m_pools.clear();
+    m_health.reset();
+    closeListener();
+    if (m_reserve >= 0) {
+        close(m_reserve);
+        m_reserve = -1;
+    }
+}
+
+
+void Worker::shutdown() {
+    m_selector.stop();
+}
+
+
+void Worker::drain() {
+    m_selector.post([this] { do_drain(); });
+}
+
+
+void Worker::do_drain()
+{
+    if (m_draining) {
+        return;
+    }
+    m_draining = true;
+
+    if (m_config.drainTimeout == 0) {
+        m_selector.stop();
+        return;
+    }
+    std::clog << "worker: draining" << std::endl;
+    m_selector.addTimer(m_config.drainTimeout, [this]
+    {
+        std::clog << "worker: drain timed out" << std::endl;
+        m_selector.stop();
+    });
+
+    // The listener is closed after the last accept on io_uring is back.
+    // Another process may still accept on it, so it is not shut down.
+    if (m_selector.completions()) {
+        m_selector.cancelOperations(m_listener);
+    } else {
+        closeListener();
+    }
+    checkDrained();
+}
+
+
+void Worker::checkDrained()
+{
+    if (m_draining && !m_connections && !m_connects) {
+        m_selector.stop();
+    }
+}
+
+
+void Worker::closeListener()
+{
+    if (m_listener >= 0) {
+        m_selector.removeEvents(m_listener);
+        close(m_listener);
+        m_listener = -1;
+    }
+}
+
+
+void Worker::do_accept()
+{
+    if (m_selector.completions()) {
+        ++m_accepting;
+        m_selector.submitAccept(m_listener, [this](int client)
+        {
+            --m_accepting;
+            if (client >= 0) {
+                do_serve(client);
+            } else if ((client == -EMFILE || client == -ENFILE) &&
+                       !m_draining)
+            {
+                shed();
+                return pauseAccepting();
+            } else if (client != -ECANCELED) {
+                errno = -client;
+                perror("accept");
+            }
+            if (!m_draining && client != -ECANCELED) {
+                this->do_accept();
+            } else if (m_draining && m_accepting == 0) {
+                closeListener();
+            }
+        });
+        return;
+    }
+
+    // A batch per wakeup, the clients left wait for the next one.
+    m_selector.addReadEvent(m_listener, [this](int)
+    {
+        for (unsigned i = 0; i < m_config.acceptBatch; ++i)
+        {
+            int client = accept4(m_listener, nullptr, nullptr, SOCK_NONBLOCK);
+            if (client < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    m_selector.wouldBlock(m_listener, POLLIN);
+                } else if (errno == EMFILE || errno == ENFILE) {
+                    shed();
+                    return pauseAccepting();
+                } else {
+                    perror("accept");
+                }
+                break;
+            }
+            do_serve(client);
+        }
+        this->do_accept();
+    });
+}
+
+
+// Turns a client away at once. The reset spares the proxy a TIME_WAIT
+// and tells the client not to wait for an answer.
+static void reject(int client)
+{
+    struct linger linger = {1, 0};
+    setsockopt(client, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    close(client);
+}
+
+
+// Out of descriptors a client cannot be accepted, so it stays queued
+// and the listener keeps waking the loop up. The reserve makes room to
+// accept the queued clients one by one and turn them away.
+void Worker::shed()
+{
+    if (m_reserve < 0) {
+        return;
+    }
+    close(m_reserve);
+    for (unsigned i = 0; i < m_config.acceptBatch; ++i)
+    {
+        int client = accept4(m_listener, nullptr, nullptr, SOCK_NONBLOCK);
+        if (client < 0) {
+            break;
+        }
+        m_metrics.shedConnections.add();
+        reject(client);
+    }
+    m_reserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+
+// Accepting again at once would fail again, until a connection closes.
+void Worker::pauseAccepting()
+{
+    m_selector.addTimer(ACCEPT_PAUSE_MS, [this]
+    {
+        if (m_reserve < 0) {
+            m_reserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        }
+        if (!m_draining) {
+            do_accept();
+        } else if (m_accepting == 0) {
+            closeListener();
+        }
+    });
+}
+
+
+void Worker::do_serve(int client)
+{
+    uint64_t accepted = traceNow();
+    ++m_accepted;
+    m_metrics.accepted.add();
+
+    Address addr;
+    const Address* from = clientAddress(client, addr);
+    uint32_t slot = 0;
+    if (m_admission && !admit(client, from, slot)) {
+        return;
+    }
+
+    size_t backend = m_balancer.pick(from);
+    m_balancer.acquire(backend);
+
+    Upstream up;
+    if (!m_pools.empty() && m_pools[backend]->acquire(up)) {
+        createConnection(client, backend, up.sock, up.ssl, accepted, slot);
+    } else {
+        do_connect(client, backend, 0, accepted, slot);
+    }
+}
+
+
+// The same option fails on every connection, it is only told once.
+void Worker::socketOptionFailed()
+{
+    if (m_metrics.socketOptionErrors.value() == 0) {
+        perror("setsockopt");
+    }
+    m_metrics.socketOptionErrors.add();
+}
+
+
+bool Worker::admit(int client, const Address* addr, uint32_t& slot)
+{
+    Counter *rejected;
+    switch (m_admission->admit(addr, slot)) {
+    case Admission::Verdict::Admitted:
+        return true;
+    case Admission::Verdict::Connections:
+        rejected = &m_metrics.rejectedConnections;
+        break;
+    case Admission::Verdict::ClientConnections:
+        rejected = &m_metrics.rejectedClientConnections;
+        break;
+    case Admission::Verdict::Rate:
+        rejected = &m_metrics.rejectedRate;
+        break;
+    default:
+        rejected = &m_metrics.rejectedClientRate;
+        break;
+    }
+    rejected->add();
+    reject(client);
+    return false;
+}
+
+
+void Worker::releaseClient(uint32_t slot)
+{
+    if (m_admission) {
+        m_admission->release(slot);
+    }
+}
+
+
+const Address* Worker::clientAddress(int client, Address& addr)
+{
+    // Only consistent hashing and per-client admission look at it.
+    if (m_config.balancing != Balancer::Policy::ConsistentHash &&
+        !(m_admission && m_admission->perClient()))
+    {
+        return nullptr;
+    }
+    addr.len = sizeof(addr.storage);
+    if (getpeername(client, addr.get(), &addr.len) != 0 ||
+        (addr.family() != AF_INET && addr.family() != AF_INET6))
+    {
+        return nullptr;
+    }
+    return &addr;
+}
+
+
+void Worker::do_connect(int client, unsigned backend, unsigned tries,
+                        uint64_t accepted, uint32_t slot)
+{
+    const Balancer::Backend& to = m_balancer[backend];
+
+    int server = createNonblockingSocket(to.address().family());
+    if (server >= 0 && !tuneUpstreamSocket(server, m_config.socketOptions)) {
+        socketOptionFailed();
+    }
+    if (server < 0) {
+        traceFailed(accepted, backend);
+        m_balancer.release(backend);
+        if (errno == EMFILE || errno == ENFILE) {
+            m_metrics.shedConnections.add();
+            reject(client);
+        } else {
+            ::shutdown(client, SHUT_RDWR);
+            close(client);
+        }
+        releaseClient(slot);
+        checkDrained();
+        return;
+    }
+
+    Connect *c = new (m_connectPool.allocate(sizeof(Connect))) Connect();
+    c->prev = nullptr;
+    c->next = m_connects;
+    if (m_connects) {
+        m_connects->prev = c;
+    }
+    m_connects = c;
+    c->client = client;
+    c->server = server;
+    c->backend = backend;
+    c->tries = tries;
+    c->accepted = accepted;
+    c->slot = slot;
+    c->submitted = false;
+    c->timedOut = false;
+    c->start = Metrics::Clock::now();
+
+    if (m_config.connectTimeout > 0) {
+        m_selector.startTimer(c->timer, m_config.connectTimeout,
+                              [this, c] { do_connect_timeout(c); });
+    }
+
+    if (m_selector.completions())
+    {
+        c->submitted = true;
+        m_selector.submitConnect(server, to.address(), [this, c](int res) {
+            c->submitted = false;
+            do_connected(c, -res);
+        });
+        return;
+    }
+
+    int err = connect(server, to.address());
+    if (err != 0 && err != EINPROGRESS) {
+        return do_connected(c, err);
+    }
+
+    m_selector.addWriteEvent(server, [this, c](int server) {
+        do_connected(c, getConnectResult(server));
+    });
+}
+
+
+void Worker::do_connect_timeout(Connect* c)
+{
+    m_metrics.connectTimeouts.add();
+    if (c->submitted) {
+        // Shutting a connecting socket down aborts the connect, which
+        // then completes with an error.
+        c->timedOut = true;
+        ::shutdown(c->server, SHUT_RDWR);
+        return;
+    }
+    do_connected(c, ETIMEDOUT);
+}
+
+
+void Worker::do_connected(Connect* c, int err)
+{
+    int client = c->client;
+    int server = c->server;
+    unsigned backend = c->backend;
+    unsigned tries = c->tries;
+    uint64_t accepted = c->accepted;
+    uint32_t slot = c->slot;
+    auto start = c->start;
+    if (c->timedOut) {
+        err = ETIMEDOUT;
+    }
+    freeConnect(c);
+
+    if (m_stopping) {
+        m_balancer.release(backend);
+        m_selector.removeEvents(server);
+        close(server);
+        close(client);
+        releaseClient(slot);
+        return;
+    }
+
+    if (err != 0) 
+    {
+        m_balancer.release(backend);
+        m_balancer.failed(backend);
+        m_metrics.connectErrors.add();
+        m_selector.removeEvents(server);
+        ::shutdown(server, SHUT_RDWR);
+        close(server);
+
+        // The client has not sent anything yet, as far as it knows it is
+        // connected to the proxy, so another backend can take it over.
+        Address addr;
+        size_t next = tries < m_config.connectRetries
+            ? m_balancer.pick(clientAddress(client, addr), backend)
+            : Balancer::NONE;
+        if (next != Balancer::NONE) {
+            m_metrics.connectRetries.add();
+            m_balancer.acquire(next);
+            return do_connect(client, next, tries + 1, accepted, slot);
+        }
+        traceFailed(accepted, backend);
+        ::shutdown(client, SHUT_RDWR);
+        close(client);
+        releaseClient(slot);
+        checkDrained();
+        return;
+    }
+    m_metrics.connectLatency.observe(Metrics::since(start));
+    if (!m_enableSSL) {
+        m_balancer.succeeded(backend);
+    }
+    createConnection(client, backend, server, nullptr, accepted, slot);
+}
+
+
+void Worker::freeConnect(Connect* c)
+{
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        m_connects = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+    c->~Connect();
+    m_connectPool.deallocate(c, sizeof(Connect));
+}
+
+
+void Worker::do_refresh()
+{
+    m_selector.addTimer(m_config.dnsTtl * 1000, [this] { do_refresh(); });
+
+    Address addr;
+    for (size_t i = 0; i < m_balancer.size(); ++i)
+    {
+        const Balancer::Backend& backend = m_balancer[i];
+        if (makeAddress(backend.host.c_str(), backend.port, addr)) {
+            continue;
+        }
+        m_resolver->resolve(backend.host, backend.port, &m_selector,
+            [this, i](int err, const std::vector<Address>& addrs) {
+                do_resolved(i, err, addrs);
+            });
+    }
+}
+
+
+void Worker::do_resolved(size_t backend, int err,
+                         const std::vector<Address>& addrs)
+{
+    // A failed lookup keeps the addresses the backend had.
+    if (err != 0) {
+        m_metrics.dnsErrors.add();
+        std::clog << "backend " << m_balancer[backend].peer << ": "
+                  << gai_strerror(err) << std::endl;
+        return;
+    }
+    m_metrics.dnsLookups.add();
+    if (!m_balancer.update(backend, addrs)) {
+        return;
+    }
+    std::clog << "backend " << m_balancer[backend].peer << ": now at";
+    for (auto& addr : addrs) {
+        std::clog << " " << addr.string();
+    }
+    std::clog << std::endl;
+}
+
+
+void Worker::createConnection(int client, size_t backend, int server,
+                              SSL* ssl, uint64_t accepted, uint32_t slot)
+{
+    uint64_t connected = traceNow();
+    void *mem = m_connectionPool.allocate(CONNECTION_SIZE);
+    IConnection *conn;
+    try {
+        if (m_enableSSL || m_terminateTLS) {
+            conn = new (mem) SSLConnection(this, &m_selector, client, server,
+                m_balancer[backend].peer, m_terminateTLS, m_enableSSL, ssl);
+        } else {
+            conn = new (mem) Connection(
+                this, &m_selector, client, server, m_config.splice);
+        }
+    }
+    catch (SSLException& e) {
+        // Only this client fails, the loop goes on.
+        std::clog << "connection " << client << ": " << e.what()
+                  << std::endl;
+        m_metrics.connectionErrors.add();
+        m_connectionPool.deallocate(mem, CONNECTION_SIZE);
+        SSL_free(ssl);
+        close(server);
+        close(client);
+        m_balancer.release(backend);
+        releaseClient(slot);
+        checkDrained();
+        return;
+    }
+
+    conn->m_backend = backend;
+    conn->m_slot = slot;
+    conn->m_trace.accepted = accepted;
+    conn->m_trace.connected = connected;
+    conn->m_next = m_connections;
+    if (m_connections) {
+        m_connections->m_prev = conn;
+    }
+    m_connections = conn;
+    m_metrics.connectionsOpened.add();
+
+    conn->m_opened = conn->m_active = m_selector.now();
+    watch(conn);
+}
+
+
+void Worker::watch(IConnection* conn)
+{
+    uint64_t deadline = UINT64_MAX;
+    if (m_config.lifetime > 0) {
+        deadline = std::min(deadline, conn->m_opened + m_config.lifetime);
+    }
+    if (conn->m_handshaking && m_config.handshakeTimeout > 0) {
+        deadline = std::min(deadline,
+                            conn->m_opened + m_config.handshakeTimeout);
+    }
+    if (m_config.idleTimeout > 0) {
+        deadline = std::min(deadline, conn->m_active + m_config.idleTimeout);
+    }
+    if (deadline == UINT64_MAX) {
+        return;
+    }
+
+    uint64_t now = m_selector.now();
+    m_selector.startTimer(conn->m_deadline, deadline > now ? deadline - now : 0,
+                          [this, conn] { do_expire(conn); });
+}
+
+
+void Worker::do_expire(IConnection* conn)
+{
+    uint64_t now = m_selector.now();
+    Counter *timeout = nullptr;
+
+    if (m_config.lifetime > 0 &&
+        now >= conn->m_opened + m_config.lifetime)
+    {
+        timeout = &m_metrics.lifetimeTimeouts;
+    }
+    else if (conn->m_handshaking && m_config.handshakeTimeout > 0 &&
+             now >= conn->m_opened + m_config.handshakeTimeout)
+    {
+        timeout = &m_metrics.handshakeTimeouts;
+    }
+    else if (m_config.idleTimeout > 0 &&
+             now >= conn->m_active + m_config.idleTimeout)
+    {
+        timeout = &m_metrics.idleTimeouts;
+    }
+
+    if (!timeout) {
+        return watch(conn);
+    }
+    timeout->add();
+    conn->close();
+}
+
+
+// A client whose upstream connect failed or timed out, which has no
+// connection to push the trace at close.
+void Worker::traceFailed(uint64_t accepted, size_t backend)
+{
+    if (m_traces.enabled()) {
+        ConnectionTrace trace;
+        trace.accepted = accepted;
+        m_traces.push(trace, backend);
+    }
+}
+
+
+void Worker::removeConnection(IConnection* conn) 
+{
+    if (conn->m_prev) {
+        conn->m_prev->m_next = conn->m_next;
+    } else {
+        m_connections = conn->m_next;
+    }
+    if (conn->m_next) {
+        conn->m_next->m_prev = conn->m_prev;
+    }
+
+    size_t backend = conn->m_backend;
+    uint32_t slot = conn->m_slot;
+    if (m_traces.enabled()) {
+        m_traces.push(conn->m_trace, backend);
+    }
+    conn->~IConnection();
+    m_connectionPool.deallocate(conn, CONNECTION_SIZE);
+    m_balancer.release(backend);
+    releaseClient(slot);
+    m_metrics.connectionsClosed.add();
+    checkDrained();
+}
+
+void Worker::reportUpstream(IConnection* conn, bool healthy)
+{
+    if (healthy) {
+        m_balancer.succeeded(conn->m_backend);
+    } else {
+        m_balancer.failed(conn->m_backend);
+    }
+}
+
+
+void Worker::closeConnections() 
+{
+    m_stopping = true;
+
+    // Connects on io_uring end when they are cancelled, the others are
+    // only waiting for readiness.
+    Connect *c = m_connects;
+    while (c) {
+        Connect *next = c->next;
+        m_selector.stopTimer(c->timer);
+        if (!c->submitted) {
+            do_connected(c, ECANCELED);
+        }
+        c = next;
+    }
+
+    // Closing a connection unlinks and destroys it, at once or when its
+    // operations still running on io_uring have been cancelled or its
+    // handshake has come back.
+    IConnection *conn = m_connections;
+    while (conn) {
+        IConnection *next = conn->m_next;
+        m_selector.stopTimer(conn->m_deadline);
+        conn->close();
+        conn = next;
+    }
+    m_selector.drain();
+
+    // A connection with a handshake on a handshake thread is destroyed
+    // when the handshake comes back.
+    for (int tries = 0; tries < 100 &&
+         m_metrics.handshakesOffloaded.value() !=
+         m_metrics.handshakesReturned.value(); ++tries)
+    {
+        m_selector.runPosted(DRAIN_MS);
+    }
+}
@@ -0,0 +1,184 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "admission.h"
+#include "balancer.h"
+#include "buffer_pool.h"
+#include "config.h"
+#include "handshake_pool.h"
+#include "health_checker.h"
+#include "resolver.h"
+#include "selector.h"
+#include "slab_pool.h"
+#include "trace.h"
+#include "upstream_pool.h"
+
+
+class IConnection
+{
+    friend class Worker;
+
+    // Links of the worker's list of open connections.
+    IConnection *m_prev = nullptr;
+    IConnection *m_next = nullptr;
+    size_t       m_backend = 0; // index in the worker's balancer
+    Timer        m_deadline;    // of the first timeout that can expire
+    uint64_t     m_opened = 0;  // selector time
+    uint32_t     m_slot = 0;    // of the client in Admission
+
+protected:
+    // Selector time of the last byte relayed; the idle timeout is only
+    // checked against it when the deadline fires.
+    uint64_t m_active = 0;
+    bool     m_handshaking = false; // a TLS handshake is not finished
+    // Kept in the worker's trace ring when the connection is removed;
+    // the worker stamps the accept and the connect, the rest is up to
+    // the connection.
+    ConnectionTrace m_trace;
+
+public:
+    virtual ~IConnection() {}
+    virtual void close() = 0;
+};
+
+
+// One event loop of the proxy. Every worker has its own listener bound
+// with SO_REUSEPORT when there are several of them, so the kernel
+// spreads the clients and a connection stays on the worker that
+// accepted it.
+//
+// Connection objects are carved out of a slab pool and linked into an
+// intrusive list, so that steady-state accepting does not allocate.
+// Their relay buffers come from a buffer pool of the worker.
+//
+// Timeouts run on the selector's timer wheel. A pending connect has a
+// timer that fails it like a refused one. A connection has one timer
+// for its earliest deadline (handshake, idle or lifetime) that is not
+// moved on every byte: when it fires the deadlines are worked out
+// again and it is started anew if none has passed.
+//
+// Draining stops accepting and lets the connections finish by
+// themselves until drainTimeout, when the loop stops and closes the
+// ones left.
+//
+// Clients over the admission limits are reset as soon as they are
+// accepted, before anything is opened for them. A worker out of
+// descriptors does the same with the clients queued on its listener,
+// with the help of one it keeps in reserve, and then pauses accepting.
+class Worker
+{
+    static const int DRAIN_MS = 50; // per wait for handshakes at shutdown
+    static const int ACCEPT_PAUSE_MS = 10; // when out of descriptors
+
+    // An upstream connect in progress, also carved out of a slab.
+    struct Connect
+    {
+        Connect  *prev;
+        Connect  *next;
+        int       client;
+        int       server;
+        unsigned  backend;
+        unsigned  tries;     // backends that failed before this one
+        uint64_t  accepted;  // traceNow() of the client's accept
+        uint32_t  slot;      // of the client in Admission
+        bool      submitted; // to io_uring, which completes it
+        bool      timedOut;
+        Timer     timer;
+        Metrics::Clock::time_point start;
+    };
+
+    const Config& m_config;
+    bool          m_enableSSL;    // TLS to the upstream
+    bool          m_terminateTLS; // TLS from the clients
+
+    Metrics        m_metrics;
+    Selector       m_selector;
+    int            m_listener;
+    Balancer       m_balancer;
+    Resolver      *m_resolver;   // of backends with host names
+    HandshakePool *m_handshakes; // runs TLS handshakes off the loop
+    Admission     *m_admission;  // shared by the workers
+    int            m_reserve;    // spare descriptor to turn clients away
+
+    std::vector<std::unique_ptr<UpstreamPool>> m_pools; // per backend
+    std::unique_ptr<HealthChecker>             m_health;
+
+    BufferPool   m_buffers; // relay buffers of the connections
+    TraceRing    m_traces;  // of the last closed connections
+    SlabPool     m_connectionPool;
+    IConnection *m_connections;
+    SlabPool     m_connectPool;
+    Connect     *m_connects; // in progress
+
+    unsigned long m_accepted;
+    unsigned      m_accepting; // accepts submitted to io_uring
+    bool          m_draining;
+    bool          m_stopping;  // no more retries
+
+public:
+    // id tells the workers apart, which spreads their balancing. With a
+    // resolver the host names of the backends are looked up again
+    // every dnsTtl. With handshakes TLS handshakes run on its threads.
+    // With admission clients are only served within its limits.
+    explicit Worker(const Config& config, unsigned id = 0,
+                    Resolver* resolver = nullptr,
+                    HandshakePool* handshakes = nullptr,
+                    Admission* admission = nullptr);
+    ~Worker() = default;
+
+    // Serves the clients of listener, a listening socket the worker
+    // takes over, until shutdown() or the end of a drain().
+    void listenAndServe(bool enableSSL, int listener);
+    void shutdown();
+    // Like shutdown(), any thread may call it.
+    void drain();
+
+    void removeConnection(IConnection* conn);
+    // Tells the balancer how the TLS handshake with the connection's
+    // backend went.
+    void reportUpstream(IConnection* conn, bool healthy);
+
+    const Config& config() const noexcept { return m_config; }
+    HandshakePool* handshakes() const noexcept { return m_handshakes; }
+    Metrics& metrics() noexcept { return m_metrics; }
+    const Metrics& metrics() const noexcept { return m_metrics; }
+    BufferPool& buffers() noexcept { return m_buffers; }
+    const TraceRing& traces() const noexcept { return m_traces; }
+    // The names of the backends never change, any thread may read them.
+    const Balancer& balancer() const noexcept { return m_balancer; }
+private:
+    void do_accept();
+    void shed();
+    void pauseAccepting();
+    void do_drain();
+    void checkDrained();
+    void closeListener();
+    void do_serve(int client);
+    const Address* clientAddress(int client, Address& addr);
+    bool admit(int client, const Address* addr, uint32_t& slot);
+    void releaseClient(uint32_t slot);
+    void socketOptionFailed();
+    // tries counts the backends that failed before this one.
+    void do_connect(int client, unsigned backend, unsigned tries,
+                    uint64_t accepted, uint32_t slot);
+    void do_connect_timeout(Connect* c);
+    void do_connected(Connect* c, int err);
+    void traceFailed(uint64_t accepted, size_t backend);
+    void freeConnect(Connect* c);
+
+    void do_refresh();
+    void do_resolved(size_t backend, int err,
+                     const std::vector<Address>& addrs);
+
+    void createConnection(int client, size_t backend, int server, SSL* ssl,
+                          uint64_t accepted, uint32_t slot);
+    void watch(IConnection* conn);
+    void do_expire(IConnection* conn);
+    void closeConnections();
+};
+
+#endif // WORKER_H